@@ -0,0 +1,382 @@
+/*
+ * bench.c
+ * Benchmarks for the wayback_recon hot paths. The tool is compiled into this
+ * binary as a single translation unit, so static helpers are reachable.
+ *
+ * COMPILE:
+ *   gcc -std=c23 -O3 -march=native -mtune=native -pipe -pthread \
+ *       -o wayback_bench bench/bench.c -lcurl -ljansson
+ *
+ * RUN:
+ *   ./wayback_bench            # every benchmark
+ *   ./wayback_bench urlset     # only the named one
+ *   ./wayback_bench output     # JSON writer, indented and compact
+ *   ./wayback_bench cdx        # CDX JSON vs text: bytes and parse ns/row
+ *   ./wayback_bench kernels    # per-row hot paths: ns, allocations and cache misses per op
+ *
+ * Cache misses come from perf_event_open(); where it is not permitted
+ * (kernel.perf_event_paranoid, containers) the column shows n/a.
+ */
+
+#define _DEFAULT_SOURCE  // syscall() for perf_event_open
+#define WAYBACK_RECON_NO_MAIN
+#include "../wayback_recon.c"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// Allocation counter: this binary's malloc family wraps glibc's, so every
+// allocation the tool (or libc on its behalf, e.g. strdup) makes is seen.
+#if defined(__GLIBC__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long alloc_count;
+
+void *malloc(size_t size) { ++alloc_count; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { ++alloc_count; return __libc_calloc(n, size); }
+void *realloc(void *ptr, size_t size) { ++alloc_count; return __libc_realloc(ptr, size); }
+void free(void *ptr) { __libc_free(ptr); }
+#define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long alloc_count;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Synthetic corpus shaped like CDX originals: a few hosts, deep paths and
+// query strings, so hashing and comparisons see realistic lengths.
+static char **make_urls(int n) {
+    static const char *const hosts[] = { "www.example.com", "api.example.com", "cdn.example.com", "example.com" };
+    static const char *const exts[] = { "php", "html", "js", "json", "aspx", "png" };
+    char **urls = malloc((size_t)n * sizeof *urls);
+    if (!urls) { perror("malloc"); exit(1); }
+
+    uint64_t x = 0x2545f4914f6cdd1dULL;
+    char buf[MAX_URL_LEN];
+    for (int i = 0; i < n; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        snprintf(buf, sizeof(buf), "https://%s/section%u/item-%d/view.%s?id=%d&ref=%llx",
+                 hosts[x & 3], (unsigned)(x >> 8) % 64, i, exts[(x >> 20) % 6], i,
+                 (unsigned long long)(x >> 24));
+        urls[i] = strdup(buf);
+        if (!urls[i]) { perror("strdup"); exit(1); }
+    }
+    return urls;
+}
+
+static void free_urls(char **urls, int n) {
+    for (int i = 0; i < n; ++i) free(urls[i]);
+    free(urls);
+}
+
+static void bench_urlset(void) {
+    static const int sizes[] = { 10000, 100000, 1000000 };
+    printf("urlset: add_url() insert throughput\n");
+    printf("  %9s %14s %14s %14s\n", "urls", "insert ns/op", "dup ns/op", "inserts/s");
+
+    for (size_t s = 0; s < sizeof sizes / sizeof *sizes; ++s) {
+        const int n = sizes[s];
+        char **urls = make_urls(n);
+        Arena arena = {0};
+        InternTable set = { .arena = &arena };
+
+        double t0 = now_ns();
+        int added = 0;
+        for (int i = 0; i < n; ++i) added += add_url(&set, urls[i], strlen(urls[i]), NULL);
+        double t1 = now_ns();
+        int dups = 0;
+        for (int i = 0; i < n; ++i) dups += !add_url(&set, urls[i], strlen(urls[i]), NULL);
+        double t2 = now_ns();
+
+        if (added != n || dups != n) {
+            fprintf(stderr, "urlset: expected %d unique, got %d added / %d duplicates\n", n, added, dups);
+            exit(1);
+        }
+        printf("  %9d %14.1f %14.1f %14.0f\n", n, (t1 - t0) / n, (t2 - t1) / n, n / ((t1 - t0) / 1e9));
+
+        free_intern_table(&set);
+        arena_free(&arena);
+        free_urls(urls, n);
+    }
+}
+
+static void bench_output(void) {
+    const int n = 1000000;
+    printf("output: JSON writer, %d endpoints to /dev/null\n", n);
+    printf("  %9s %14s %14s\n", "style", "ns/endpoint", "MB/s");
+    if (method_rules_init(NULL) != 0) exit(1);
+
+    char **urls = make_urls(n);
+    DomainJob *job = calloc(1, sizeof *job);
+    if (!job) { perror("calloc"); exit(1); }
+    job->params.arena = &job->arena;
+    job->endpoints = malloc((size_t)n * sizeof *job->endpoints);
+    if (!job->endpoints) { perror("malloc"); exit(1); }
+    for (int i = 0; i < n; ++i) {
+        uint32_t ids[MAX_PARAM_LEN / 2];
+        Endpoint *e = &job->endpoints[job->endpoint_count++];
+        e->url = urls[i];
+        e->method = infer_method(urls[i], strlen(urls[i]), NULL, 0);
+        e->param_count = split_params(&job->params, urls[i], ids);
+        uint32_t *stored = arena_alloc(&job->arena, (size_t)e->param_count * sizeof *stored, alignof(uint32_t));
+        memcpy(stored, ids, (size_t)e->param_count * sizeof *stored);
+        e->param_ids = stored;
+    }
+
+    for (int compact = 0; compact <= 1; ++compact) {
+        const Options opts = { .compact = compact };
+        JsonWriter w;
+        jw_open(&w, "/dev/null", &opts, JSON_WRITER_BUFFER);
+
+        size_t bytes = 0;
+        double t0 = now_ns();
+        for (int i = 0; i < n; ++i) {
+            // Flush ahead so no endpoint straddles a flush and w.len counts its bytes.
+            if (w.cap - w.len < 4 * MAX_URL_LEN) jw_flush(&w);
+            const size_t before = w.len;
+            jw_item(&w, &job->endpoints[i], &job->params);
+            bytes += w.len - before;
+        }
+        jw_close(&w);
+        double t1 = now_ns();
+
+        printf("  %9s %14.1f %14.1f\n", compact ? "compact" : "indent", (t1 - t0) / n, bytes / ((t1 - t0) / 1e3));
+    }
+
+    free(job->endpoints);
+    free_intern_table(&job->params);
+    arena_free(&job->arena);
+    free(job);
+    free_urls(urls, n);
+}
+
+// Counters around one kernel run: wall time, allocations and, if the kernel
+// lets us, last-level cache misses of this thread in user space.
+typedef struct {
+    double t0;
+    unsigned long allocs;
+} Probe;
+
+static int cache_miss_fd(void) {
+    static int fd = -2;  // -2: not tried yet, -1: unavailable
+    if (fd == -2) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof attr,
+            .config = PERF_COUNT_HW_CACHE_MISSES,
+            .disabled = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0) fd = -1;
+    }
+    return fd;
+}
+
+static void probe_start(Probe *p) {
+    const int fd = cache_miss_fd();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    p->allocs = alloc_count;
+    p->t0 = now_ns();
+}
+
+static void probe_report(const Probe *p, const char *name, long ops) {
+    const double t1 = now_ns();
+    const unsigned long allocs = alloc_count - p->allocs;
+    const int fd = cache_miss_fd();
+    long long misses = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof misses) != sizeof misses) misses = -1;
+    }
+
+    char alloc_col[32] = "n/a", miss_col[32] = "n/a";
+    if (HAVE_ALLOC_COUNT) snprintf(alloc_col, sizeof(alloc_col), "%.3f", (double)allocs / ops);
+    if (misses >= 0) snprintf(miss_col, sizeof(miss_col), "%.3f", (double)misses / ops);
+    printf("  %-16s %12.1f %12s %14s\n", name, (t1 - p->t0) / ops, alloc_col, miss_col);
+}
+
+static void bench_kernels(void) {
+    static const char *const mimes[] = { "text/html", "application/json", "image/png", "text/css" };
+    const int n = 1000000;
+    printf("kernels: %d synthetic URLs, one op per URL\n", n);
+    printf("  %-16s %12s %12s %14s\n", "kernel", "ns/op", "allocs/op", "cache-miss/op");
+    if (method_rules_init(NULL) != 0) exit(1);
+
+    char **urls = make_urls(n);
+    size_t *lens = malloc((size_t)n * sizeof *lens);
+    Endpoint *endpoints = calloc((size_t)n, sizeof *endpoints);
+    if (!lens || !endpoints) { perror("malloc"); exit(1); }
+    for (int i = 0; i < n; ++i) lens[i] = strlen(urls[i]);
+
+    Arena arena = {0};
+    InternTable seen = { .arena = &arena };
+    InternTable params = { .arena = &arena };
+    Probe p;
+
+    probe_start(&p);
+    int added = 0;
+    for (int i = 0; i < n; ++i) {
+        const char *stored;
+        if (add_url(&seen, urls[i], lens[i], &stored)) endpoints[added++].url = stored;
+    }
+    probe_report(&p, "add_url", n);
+
+    probe_start(&p);
+    unsigned methods = 0;
+    for (int i = 0; i < n; ++i) {
+        const char *mime = mimes[i & 3];
+        endpoints[i].method = infer_method(urls[i], lens[i], mime, strlen(mime));
+        methods += endpoints[i].method;
+    }
+    probe_report(&p, "infer_method", n);
+
+    probe_start(&p);
+    long total_params = 0;
+    for (int i = 0; i < n; ++i) {
+        uint32_t one[MAX_PARAM_LEN / 2];
+        endpoints[i].param_count = split_params(&params, endpoints[i].url, one);
+        total_params += endpoints[i].param_count;
+    }
+    probe_report(&p, "split_params", n);
+
+    // The parameter ids are stored once, outside the measured loops.
+    uint32_t *ids = malloc((size_t)total_params * sizeof *ids);
+    if (!ids) { perror("malloc"); exit(1); }
+    uint32_t *next = ids;
+    for (int i = 0; i < n; ++i) {
+        uint32_t one[MAX_PARAM_LEN / 2];
+        const int count = split_params(&params, endpoints[i].url, one);
+        memcpy(next, one, (size_t)count * sizeof *next);
+        endpoints[i].param_ids = next;
+        next += count;
+    }
+
+    probe_start(&p);
+    qsort(endpoints, (size_t)n, sizeof *endpoints, compare_endpoints_asc);
+    probe_report(&p, "qsort (asc)", n);
+
+    const Options opts = { .compact = 1 };
+    JsonWriter w;
+    jw_open(&w, "/dev/null", &opts, JSON_WRITER_BUFFER);
+    probe_start(&p);
+    for (int i = 0; i < n; ++i) jw_item(&w, &endpoints[i], &params);
+    jw_flush(&w);
+    probe_report(&p, "json emit", n);
+    jw_close(&w);
+
+    if (added != n || methods == 0 || total_params == 0) {
+        fprintf(stderr, "kernels: unexpected corpus (%d unique)\n", added);
+        exit(1);
+    }
+    free(ids);
+    free(endpoints);
+    free(lens);
+    free_intern_table(&seen);
+    free_intern_table(&params);
+    arena_free(&arena);
+    free_urls(urls, n);
+}
+
+static void count_row(void *userp, long row, const CdxField *fields, int nfields) {
+    (void)fields;
+    if (row > 0 && nfields >= 4) ++*(long *)userp;
+}
+
+// Feeds body to a fresh parser in curl-sized pieces and returns ns per row.
+static double parse_body(const char *body, size_t len, int text, int n) {
+    CdxParser p = { .text = text };
+    long rows = 0;
+    const size_t piece = 16 * 1024;
+    double best = 0;
+    for (int rep = 0; rep < 5; ++rep) {
+        rows = 0;
+        cdx_parser_reset(&p, count_row, &rows);
+        double t0 = now_ns();
+        for (size_t off = 0; off < len; off += piece) {
+            if (cdx_parser_feed(&p, body + off, len - off < piece ? len - off : piece) != 0) {
+                fprintf(stderr, "cdx: parse error: %s\n", p.error);
+                exit(1);
+            }
+        }
+        cdx_parser_finish(&p);
+        double t1 = now_ns();
+        if (rep == 0 || t1 - t0 < best) best = t1 - t0;
+    }
+    if (rows != n || p.state != CDX_DONE) {
+        fprintf(stderr, "cdx: expected %d rows, parsed %ld\n", n, rows);
+        exit(1);
+    }
+    cdx_parser_free(&p);
+    return best / n;
+}
+
+static void bench_cdx(void) {
+    const int n = 1000000;
+    printf("cdx: %d rows, same captures in both output formats (best of 5)\n", n);
+    printf("  %9s %14s %14s\n", "format", "bytes", "parse ns/row");
+
+    char **urls = make_urls(n);
+    char *json = NULL, *text = NULL;
+    size_t json_len = 0, text_len = 0;
+    FILE *jf = open_memstream(&json, &json_len);
+    FILE *tf = open_memstream(&text, &text_len);
+    if (!jf || !tf) { perror("open_memstream"); exit(1); }
+
+    fputs("[[\"original\",\"timestamp\",\"statuscode\",\"mimetype\"]", jf);
+    for (int i = 0; i < n; ++i) {
+        const char *mime = (i & 3) ? "text/html" : "application/json";
+        const int year = 1996 + i % 30;
+        fprintf(jf, ",\n[\"%s\",\"%d0101000000\",\"200\",\"%s\"]", urls[i], year, mime);
+        fprintf(tf, "%s %d0101000000 200 %s\n", urls[i], year, mime);
+    }
+    fputs("]\n", jf);
+    fclose(jf);
+    fclose(tf);
+
+    printf("  %9s %14zu %14.1f\n", "json", json_len, parse_body(json, json_len, 0, n));
+    printf("  %9s %14zu %14.1f\n", "text", text_len, parse_body(text, text_len, 1, n));
+
+    free(json);
+    free(text);
+    free_urls(urls, n);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} Bench;
+
+static const Bench benches[] = {
+    { "urlset", bench_urlset },
+    { "output", bench_output },
+    { "cdx", bench_cdx },
+    { "kernels", bench_kernels },
+};
+
+int main(int argc, char *argv[]) {
+    int ran = 0;
+    for (size_t i = 0; i < sizeof benches / sizeof *benches; ++i) {
+        if (argc > 1 && strcmp(argv[1], benches[i].name) != 0) continue;
+        benches[i].run();
+        ++ran;
+    }
+    if (!ran) {
+        fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * cdx_mock.c
+ * Local stand-in for the Wayback CDX server, so end-to-end runs can be
+ * measured without archive.org. Serves synthetic captures (or a recorded
+ * text listing) with the paging the real server uses: limit + showResumeKey
+ * chains, and showNumPages + page. Latency, bandwidth limits, 503s and
+ * truncated replies can be injected.
+ *
+ * COMPILE:
+ *   gcc -std=c23 -O2 -pthread -o cdx_mock bench/cdx_mock.c
+ *
+ * RUN:
+ *   ./cdx_mock -n 100000                       # 100k captures per domain on :8642
+ *   ./cdx_mock -n 1000000 -d 50 -b 20M -e 0.05 # 50 ms latency, 20 MiB/s, 5% 503s
+ *   ./cdx_mock -r captures.txt                 # replay a recorded listing, fetched with
+ *                                              # fl=original,timestamp,statuscode,mimetype
+ *   ./wayback_recon --cdx-url http://127.0.0.1:8642/cdx/search/cdx example.com
+ *
+ * Understood parameters: url, output=json, limit, showResumeKey, resumeKey,
+ * showNumPages, page, from and to. Filters and collapse are ignored; every
+ * synthetic URL is unique already.
+ */
+
+#define _GNU_SOURCE  // strcasestr
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define REQUEST_MAX (16 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+#define ROW_MAX 4096
+
+typedef struct {
+    int port;
+    long rows;            // synthetic captures per domain
+    long page_rows;       // captures per page= page
+    long latency_ms;      // before every reply
+    long long bandwidth;  // bytes per second per reply, 0: unlimited
+    double error_rate;    // replies that are a 503 with Retry-After
+    double cut_rate;      // replies cut off halfway
+    uint64_t seed;
+    int verbose;
+} Config;
+
+// A recorded capture: the four fields, NUL-terminated, in one allocation.
+typedef struct {
+    const char *field[4];
+} Row;
+
+static Config cfg = { .port = 8642, .rows = 1000, .page_rows = 50000 };
+static Row *recorded;
+static long recorded_count;
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+// "1500", "512K", "2M" (powers of 1024).
+static long long parse_size(const char *s) {
+    char *end = NULL;
+    long long v = strtoll(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; break;
+        case 'm': case 'M': v <<= 20; break;
+        case 'g': case 'G': v <<= 30; break;
+    }
+    return v;
+}
+
+static uint64_t next_rand(uint64_t *x) {
+    *x ^= *x << 13; *x ^= *x >> 7; *x ^= *x << 17;
+    return *x;
+}
+
+static double rand_unit(uint64_t *x) {
+    return (double)(next_rand(x) >> 11) / (double)(1ULL << 53);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long long ms) {
+    if (ms <= 0) return;
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+// One "original timestamp statuscode mimetype" line per capture; the URL is
+// everything before the last three tokens.
+static void load_recorded(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) die(path);
+    char *line = NULL;
+    size_t cap = 0, row_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        char *cut[3];
+        char *q = line + len;
+        int ok = 1;
+        for (int i = 0; i < 3 && ok; ++i) {
+            while (q > line && q[-1] != ' ') --q;
+            if (q == line) ok = 0;
+            else cut[i] = --q;
+        }
+        if (!ok) continue;
+
+        char *copy = strdup(line);
+        if (!copy) die("strdup");
+        for (int i = 0; i < 3; ++i) copy[cut[i] - line] = '\0';
+        if (recorded_count == (long)row_cap) {
+            row_cap = row_cap ? row_cap * 2 : 4096;
+            recorded = realloc(recorded, row_cap * sizeof *recorded);
+            if (!recorded) die("realloc");
+        }
+        recorded[recorded_count++] = (Row){ { copy, copy + (cut[2] - line) + 1, copy + (cut[1] - line) + 1,
+                                              copy + (cut[0] - line) + 1 } };
+    }
+    free(line);
+    fclose(fp);
+    if (recorded_count == 0) {
+        fprintf(stderr, "%s: no captures\n", path);
+        exit(1);
+    }
+    cfg.rows = recorded_count;
+}
+
+// Capture i of domain, shaped like real traffic: logins, APIs, static assets
+// and pages with query strings, spread over thirty years.
+static void synthetic_row(const char *domain, long i, char *url, size_t url_size, char ts[15],
+                          const char **status, const char **mime) {
+    static const char *const statuses[] = { "200", "200", "200", "301", "404", "200" };
+    static const char *const mimes[] = { "text/html", "image/png", "application/json", "text/html", "text/html", "text/css" };
+    switch (i % 6) {
+        case 0: snprintf(url, url_size, "https://%s/login?user=%ld&next=/account", domain, i); break;
+        case 1: snprintf(url, url_size, "https://%s/static/img/%ld.png", domain, i); break;
+        case 2: snprintf(url, url_size, "https://%s/api/v1/update?id=%ld&token=x", domain, i); break;
+        case 3: snprintf(url, url_size, "https://www.%s/blog/%ld/post.html?ref=feed&utm_source=%ld", domain, i / 6, i); break;
+        case 4: snprintf(url, url_size, "https://%s/account/remove?item=%ld", domain, i); break;
+        default: snprintf(url, url_size, "https://cdn.%s/css/site-%ld.css", domain, i); break;
+    }
+    const unsigned long u = (unsigned long)i;
+    snprintf(ts, 15, "%04lu%02lu%02lu%02lu%02lu%02lu", 1996 + u % 30, 1 + u % 12, 1 + u % 28, u / 7 % 24,
+             u / 11 % 60, u % 60);
+    *status = statuses[i % 6];
+    *mime = mimes[i % 6];
+}
+
+// CDX bounds are prefixes: from=2020 starts at 20200101000000, to=2020 runs
+// to 20201231235959.
+static int in_range(const char *ts, const char *from, const char *to) {
+    if (from[0] && strncmp(ts, from, strlen(from)) < 0) return 0;
+    if (to[0] && strncmp(ts, to, strlen(to)) > 0) return 0;
+    return 1;
+}
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    long long started;  // for bandwidth pacing
+    long long sent;
+    int broken;         // the client went away
+} Reply;
+
+static void send_all(Reply *r, const char *data, size_t len) {
+    while (len > 0 && !r->broken) {
+        ssize_t n = send(r->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            r->broken = 1;
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+        r->sent += n;
+    }
+    if (cfg.bandwidth > 0) {
+        const long long due = r->started + r->sent * 1000 / cfg.bandwidth;
+        sleep_ms(due - now_ms());
+    }
+}
+
+static void reply_flush(Reply *r) {
+    if (r->len == 0) return;
+    char head[32];
+    const int n = snprintf(head, sizeof(head), "%zx\r\n", r->len);
+    send_all(r, head, (size_t)n);
+    memcpy(r->buf + r->len, "\r\n", 2);
+    send_all(r, r->buf, r->len + 2);
+    r->len = 0;
+}
+
+static void reply_put(Reply *r, const char *s, size_t n) {
+    if (r->len + n > CHUNK_SIZE) reply_flush(r);
+    while (n > CHUNK_SIZE) {
+        memcpy(r->buf, s, CHUNK_SIZE);
+        r->len = CHUNK_SIZE;
+        reply_flush(r);
+        s += CHUNK_SIZE;
+        n -= CHUNK_SIZE;
+    }
+    memcpy(r->buf + r->len, s, n);
+    r->len += n;
+}
+
+static void reply_json_string(Reply *r, const char *s) {
+    char out[ROW_MAX * 2];
+    size_t n = 0;
+    out[n++] = '"';
+    for (; *s && n < sizeof(out) - 8; ++s) {
+        const unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') { out[n++] = '\\'; out[n++] = (char)c; }
+        else if (c < 0x20) n += (size_t)snprintf(out + n, 8, "\\u%04x", c);
+        else out[n++] = (char)c;
+    }
+    out[n++] = '"';
+    reply_put(r, out, n);
+}
+
+static void reply_row(Reply *r, int json, int first, const char *const field[4]) {
+    if (json) {
+        reply_put(r, first ? "[[" : ",\n[", first ? 2 : 3);
+        for (int i = 0; i < 4; ++i) {
+            if (i > 0) reply_put(r, ",", 1);
+            reply_json_string(r, field[i]);
+        }
+        reply_put(r, "]", 1);
+    } else {
+        for (int i = 0; i < 4; ++i) {
+            reply_put(r, field[i], strlen(field[i]));
+            reply_put(r, i < 3 ? " " : "\n", 1);
+        }
+    }
+}
+
+typedef struct {
+    char domain[256];
+    int json;
+    long limit;         // -1: everything
+    int show_resume_key;
+    long resume_at;     // first capture index to look at
+    int num_pages;
+    long page;          // -1: not paged
+    char from[15];
+    char to[15];
+} Query;
+
+static void url_decode(char *s) {
+    char *out = s;
+    for (; *s; ++s) {
+        if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            const char hex[3] = { s[1], s[2], 0 };
+            *out++ = (char)strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *out++ = *s == '+' ? ' ' : *s;
+        }
+    }
+    *out = '\0';
+}
+
+static void parse_query(char *target, Query *q) {
+    *q = (Query){ .limit = -1, .page = -1 };
+    char *qs = strchr(target, '?');
+    if (!qs) return;
+    for (char *save = NULL, *kv = strtok_r(qs + 1, "&", &save); kv; kv = strtok_r(NULL, "&", &save)) {
+        char *v = strchr(kv, '=');
+        if (v) *v++ = '\0';
+        else v = "";
+        url_decode(v);
+        if (strcmp(kv, "url") == 0) {
+            const char *scheme = strstr(v, "://");
+            snprintf(q->domain, sizeof(q->domain), "%s", scheme ? scheme + 3 : v);
+            q->domain[strcspn(q->domain, "/")] = '\0';
+        } else if (strcmp(kv, "output") == 0) q->json = strcmp(v, "json") == 0;
+        else if (strcmp(kv, "limit") == 0) q->limit = atol(v);
+        else if (strcmp(kv, "showResumeKey") == 0) q->show_resume_key = strcmp(v, "true") == 0;
+        else if (strcmp(kv, "resumeKey") == 0) {
+            // Our keys are "mock <index>"; real ones are "<urlkey> <timestamp>".
+            const char *sp = strrchr(v, ' ');
+            q->resume_at = atol(sp ? sp + 1 : v);
+        } else if (strcmp(kv, "showNumPages") == 0) q->num_pages = strcmp(v, "true") == 0;
+        else if (strcmp(kv, "page") == 0) q->page = atol(v);
+        else if (strcmp(kv, "from") == 0) snprintf(q->from, sizeof(q->from), "%s", v);
+        else if (strcmp(kv, "to") == 0) snprintf(q->to, sizeof(q->to), "%s", v);
+    }
+}
+
+static void send_simple(int fd, const char *status, const char *extra, const char *body) {
+    char msg[512];
+    const int n = snprintf(msg, sizeof(msg), "HTTP/1.1 %s\r\n%sContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s",
+                           status, extra, strlen(body), body);
+    Reply r = { .fd = fd, .started = now_ms() };
+    send_all(&r, msg, (size_t)n);
+}
+
+// Streams the captures a query selects as a chunked reply. Returns 0 if the
+// connection can be kept, -1 if it was cut or broke.
+static int serve_rows(int fd, const Query *q, int cut) {
+    static const char *const header[4] = { "original", "timestamp", "statuscode", "mimetype" };
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n";
+    Reply r = { .fd = fd, .buf = malloc(CHUNK_SIZE + 2), .started = now_ms() };
+    if (!r.buf) die("malloc");
+    send_all(&r, head, sizeof(head) - 1);
+
+    long begin = q->resume_at, end = cfg.rows;
+    if (q->page >= 0) {
+        begin = q->page * cfg.page_rows;
+        end = begin + cfg.page_rows < cfg.rows ? begin + cfg.page_rows : cfg.rows;
+    }
+    long emitted = 0, i = begin;
+    const long cut_after = cut ? (q->limit > 0 ? q->limit : end - begin) / 2 : -1;
+    if (q->json) reply_row(&r, 1, 1, header);
+
+    char url[ROW_MAX], ts[15];
+    for (; i < end && (q->limit < 0 || emitted < q->limit) && !r.broken; ++i) {
+        const char *field[4];
+        if (recorded) {
+            memcpy(field, recorded[i].field, sizeof(field));
+        } else {
+            synthetic_row(q->domain, i, url, sizeof(url), ts, &field[2], &field[3]);
+            field[0] = url;
+            field[1] = ts;
+        }
+        if (!in_range(field[1], q->from, q->to)) continue;
+        if (emitted == cut_after) {
+            reply_flush(&r);
+            free(r.buf);
+            return -1;
+        }
+        reply_row(&r, q->json, 0, field);
+        ++emitted;
+    }
+
+    // More captures may be left: point at the next index to look at.
+    if (q->page < 0 && q->show_resume_key && i < end) {
+        char key[64];
+        const int n = snprintf(key, sizeof(key), "mock %ld", i);
+        if (q->json) {
+            reply_put(&r, ",\n[],\n[", 7);
+            reply_json_string(&r, key);
+            reply_put(&r, "]", 1);
+        } else {
+            reply_put(&r, "\n", 1);
+            reply_put(&r, key, (size_t)n);
+            reply_put(&r, "\n", 1);
+        }
+    }
+    if (q->json) reply_put(&r, "]\n", 2);
+    reply_flush(&r);
+    send_all(&r, "0\r\n\r\n", 5);
+    free(r.buf);
+    return r.broken ? -1 : 0;
+}
+
+static void *serve_connection(void *arg) {
+    const int fd = (int)(intptr_t)arg;
+    uint64_t rng = cfg.seed ^ (0x9E3779B97F4A7C15ULL * (uint64_t)(fd + 1)) ^ (uint64_t)now_ms();
+    if (!rng) rng = 1;
+    char *req = malloc(REQUEST_MAX + 1);
+    if (!req) die("malloc");
+    size_t have = 0;
+
+    for (;;) {
+        req[have] = '\0';
+        char *end_of_head;
+        while (!(end_of_head = strstr(req, "\r\n\r\n"))) {
+            if (have == REQUEST_MAX) goto done;
+            ssize_t n = recv(fd, req + have, REQUEST_MAX - have, 0);
+            if (n <= 0) goto done;
+            have += (size_t)n;
+            req[have] = '\0';
+        }
+        *end_of_head = '\0';
+        const size_t used = (size_t)(end_of_head + 4 - req);
+        const int close_after = strcasestr(req, "\r\nConnection: close") != NULL;
+
+        char method[8], target[REQUEST_MAX];
+        if (sscanf(req, "%7s %16383s", method, target) != 2 || strcmp(method, "GET") != 0) {
+            send_simple(fd, "400 Bad Request", "Connection: close\r\n", "bad request\n");
+            goto done;
+        }
+        if (cfg.verbose) fprintf(stderr, "GET %s\n", target);
+        Query q;
+        parse_query(target, &q);
+
+        sleep_ms(cfg.latency_ms);
+        int status = 0;
+        if (cfg.error_rate > 0 && rand_unit(&rng) < cfg.error_rate) {
+            send_simple(fd, "503 Service Unavailable", "Retry-After: 1\r\n", "busy\n");
+        } else if (q.domain[0] == '\0') {
+            send_simple(fd, "400 Bad Request", "", "missing url\n");
+        } else if (q.num_pages) {
+            char body[32];
+            snprintf(body, sizeof(body), "%ld\n", (cfg.rows + cfg.page_rows - 1) / cfg.page_rows);
+            send_simple(fd, "200 OK", "", body);
+        } else {
+            status = serve_rows(fd, &q, cfg.cut_rate > 0 && rand_unit(&rng) < cfg.cut_rate);
+        }
+        if (status != 0 || close_after) break;
+
+        memmove(req, req + used, have - used);
+        have -= used;
+    }
+done:
+    free(req);
+    close(fd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-p PORT] [-n ROWS | -r FILE] [-P PAGE_ROWS] [-d MS] [-b BYTES/S]\n"
+            "          [-e RATE] [-x RATE] [-s SEED] [-v]\n"
+            "  -p PORT       listen on 127.0.0.1:PORT (default: 8642)\n"
+            "  -n ROWS       synthetic captures per domain (default: 1000)\n"
+            "  -r FILE       serve a recorded text listing for every domain instead\n"
+            "  -P PAGE_ROWS  captures per page= page (default: 50000)\n"
+            "  -d MS         latency before every reply\n"
+            "  -b BYTES/S    bandwidth of every reply, K/M/G suffixes\n"
+            "  -e RATE       fraction of requests answered 503 with Retry-After: 1\n"
+            "  -x RATE       fraction of replies cut off halfway\n"
+            "  -s SEED       seed for the error injection\n"
+            "  -v            log every request\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:r:P:d:b:e:x:s:vh")) != -1) {
+        switch (opt) {
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'n': cfg.rows = atol(optarg); break;
+            case 'r': load_recorded(optarg); break;
+            case 'P': cfg.page_rows = atol(optarg); break;
+            case 'd': cfg.latency_ms = atol(optarg); break;
+            case 'b': cfg.bandwidth = parse_size(optarg); break;
+            case 'e': cfg.error_rate = atof(optarg); break;
+            case 'x': cfg.cut_rate = atof(optarg); break;
+            case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+            case 'v': cfg.verbose = 1; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.rows < 0 || cfg.page_rows <= 0 || cfg.port <= 0 || cfg.port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    const int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) die("socket");
+    const int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)cfg.port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) die("bind");
+    if (listen(lfd, 512) != 0) die("listen");
+    fprintf(stderr, "cdx_mock: %ld captures per domain on http://127.0.0.1:%d/cdx/search/cdx\n", cfg.rows, cfg.port);
+
+    for (;;) {
+        const int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            die("accept");
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, serve_connection, (void *)(intptr_t)fd) != 0) die("pthread_create");
+        pthread_attr_destroy(&attr);
+    }
+}
@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+# e2e.sh
+# End-to-end benchmark: builds wayback_recon and bench/cdx_mock, serves one
+# synthetic domain of each size locally and reports wall time, rows/s and the
+# tool's peak RSS.
+#
+# RUN (from the repository root):
+#   bench/e2e.sh                      # 1k, 100k and 1M-row domains
+#   bench/e2e.sh 50000                # only the given sizes
+#   MOCK_ARGS="-d 50 -b 20M -e 0.02" bench/e2e.sh   # latency, bandwidth, 503s
+#   TOOL_ARGS="--cdx-output text -P 8" bench/e2e.sh # options for wayback_recon
+#
+# CC, CFLAGS and LIBS override the compiler, its flags and the libraries;
+# BUILD keeps the binaries in that directory instead of a temporary one.
+set -eu
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--std=c23 -O3 -march=native -mtune=native -pipe}
+LIBS=${LIBS:--lcurl -ljansson}
+PORT=${PORT:-8642}
+if [ -z "${BUILD:-}" ]; then BUILD=$(mktemp -d); scratch=$BUILD; fi
+SIZES=("$@")
+[ ${#SIZES[@]} -gt 0 ] || SIZES=(1000 100000 1000000)
+
+# shellcheck disable=SC2086
+$CC $CFLAGS -pthread -o "$BUILD/wayback_recon" wayback_recon.c $LIBS
+# shellcheck disable=SC2086
+$CC $CFLAGS -pthread -o "$BUILD/cdx_mock" bench/cdx_mock.c
+
+mock_pid=
+cleanup() {
+    [ -z "$mock_pid" ] || kill "$mock_pid" 2>/dev/null || true
+    [ -z "${scratch:-}" ] || rm -rf "$scratch"
+}
+trap cleanup EXIT
+
+now_ns() { date +%s%N; }
+
+# Waits for pid and sets peak to its peak RSS in KiB. VmHWM is only readable
+# while the process lives, so it is sampled until the process exits.
+wait_peak_rss() {
+    local pid=$1 hwm
+    peak=0
+    while kill -0 "$pid" 2>/dev/null; do
+        hwm=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status" 2>/dev/null || true)
+        if [ -n "$hwm" ] && [ "$hwm" -gt "$peak" ]; then peak=$hwm; fi
+        sleep 0.01
+    done
+    wait "$pid" || { echo "wayback_recon failed" >&2; exit 1; }
+}
+
+printf '%10s %10s %12s %14s\n' rows "wall s" rows/s "peak RSS MiB"
+for rows in "${SIZES[@]}"; do
+    # shellcheck disable=SC2086
+    "$BUILD/cdx_mock" -p "$PORT" -n "$rows" ${MOCK_ARGS:-} 2>/dev/null &
+    mock_pid=$!
+    for _ in $(seq 100); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+        sleep 0.05
+    done
+
+    start=$(now_ns)
+    # shellcheck disable=SC2086
+    "$BUILD/wayback_recon" --cdx-url "http://127.0.0.1:$PORT/cdx/search/cdx" -o /dev/null ${TOOL_ARGS:-} \
+        example.com >/dev/null 2>&1 &
+    wait_peak_rss $!
+    end=$(now_ns)
+
+    kill "$mock_pid"
+    wait "$mock_pid" 2>/dev/null || true
+    mock_pid=
+
+    awk -v rows="$rows" -v ns="$((end - start))" -v kib="$peak" \
+        'BEGIN { s = ns / 1e9; printf "%10d %10.2f %12.0f %14.1f\n", rows, s, rows / s, kib / 1024 }'
+done
@@ -3,7 +3,7 @@
  * Bug Bounty Recon Tool using Internet Archive Wayback Machine CDX Server
  *
  * COMPILE:
- *   gcc -std=c23 -O3 -march=native -mtune=native -flto -pipe \
+ *   gcc -std=c23 -O3 -march=native -mtune=native -flto -pipe -pthread \
  *       -fomit-frame-pointer -falign-functions=32 -fno-plt -ffast-math \
  *       -static-libgcc -static-libstdc++ \
  *       -Wl,-O1 -Wl,--as-needed -Wl,--strip-all \
@@ -13,11 +13,32 @@
  * Version: 1.9.12 | Author: Izzy
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include <curl/curl.h>
 #include <jansson.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 _Static_assert(sizeof(char) == 1, "Platform must have 8-bit char");
 _Static_assert(__STDC_VERSION__ >= 202311L, "C23 or later required");
@@ -27,41 +48,396 @@ _Static_assert(__STDC_VERSION__ >= 202311L, "C23 or later required");
 #define INITIAL_CAPACITY 1024
 #define MAX_LINE_LEN 4096
 #define MAX_DOMAIN_LEN 253  // RFC 1035
+#define MAX_CONCURRENCY 1024
+#define MAX_PAGE_CONCURRENCY 64
+#define MAX_SLICES 1024
+#define DEFAULT_SLICE_CONCURRENCY 4
+#define FIRST_CAPTURE_YEAR 1996
+#define CDX_MAX_FIELDS 8
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define MAX_EPOLL_EVENTS 64
+#define MAX_THROTTLE_RETRIES 8
+#define THROTTLE_BACKOFF_MS 1000  // pause after a 429/503 without Retry-After, doubled per attempt
+#define MAX_BACKOFF_MS 60000
+#define RETRY_BACKOFF_MS 500      // first retry of a failed request, doubled per retry, jittered
+#define JSON_WRITER_BUFFER (1 << 20)
+#define MAX_FILTERS_LEN 1024  // escaped filter= params, leaves room in MAX_URL_LEN
+
+// Straight to HTTPS: the http:// endpoint only answers with a redirect.
+// --cdx-url points a run somewhere else, e.g. at bench/cdx_mock.
+#ifndef CDX_ENDPOINT
+#define CDX_ENDPOINT "https://web.archive.org/cdx/search/cdx"
+#endif
+#define DOMAIN_WRITER_BUFFER (64 * 1024)  // per-domain files, up to MAX_CONCURRENCY open
+#define MAX_THREADS 64
+#define PIPE_LANE_BLOCKS 64       // deliveries queued per parser thread before transfers pause
+#define PIPE_ROW_BATCHES 256      // parsed batches queued for the event loop before parsers wait
+#define PIPE_WRITES 64            // buffers and finished domains queued for the writer thread
+#define TRACE_BUFFER_EVENTS 4096  // per thread; a full buffer is written out by its owner
+#define TRACE_DOMAIN_LEN 64       // longer domains are cut in trace events
+#define TRACE_EVENT_MAX 1024      // formatted size bound of one event (a b/e pair)
 
 static inline int max(int a, int b) { return a > b ? a : b; }
+static inline int min(int a, int b) { return a < b ? a : b; }
 
 typedef struct {
     char *data;
     size_t size;
 } MemoryChunk;
 
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+    alignas(max_align_t) char data[];
+} ArenaBlock;
+
+// Bump allocator; everything in it is released at once by arena_free().
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+// Open-addressing interning table. Strings live in the arena and get dense ids
+// in insertion order; the slot table stores each entry's hash (0 = empty) next
+// to its id.
 typedef struct {
-    char **urls;
+    Arena *arena;
+    const char **strs;
+    uint32_t *lens;
     int count;
     int capacity;
-} URLSet;
+    uint64_t *slot_hash;
+    uint32_t *slot_index;
+    size_t slot_mask;  // slot count - 1, slot count is a power of two
+} InternTable;
+
+typedef enum {
+    METHOD_GET, METHOD_POST, METHOD_PUT, METHOD_DELETE, METHOD_PATCH, METHOD_HEAD, METHOD_OPTIONS,
+    METHOD_COUNT
+} Method;
+
+static const char *const method_names[METHOD_COUNT] = {
+    "GET", "POST", "PUT", "DELETE", "PATCH", "HEAD", "OPTIONS"
+};
+
+// Best rule ranks (0 = none, higher wins) of the patterns ending in a state.
+typedef struct {
+    uint32_t any;     // primary rules, matching anywhere
+    uint32_t refine;  // refine rules, which only apply once a primary rule matched
+    uint32_t suffix;  // extension rules, only consulted at the end of the URL path
+} MatchOut;
+
+// Multi-pattern matcher (Aho-Corasick compiled to a full DFA over a reduced,
+// case-folded alphabet). out[state] merges, by max, every pattern that ends
+// in that state, fail-link matches included, so a scan costs the same however
+// many rules are loaded.
+typedef struct {
+    uint8_t byte_class[256];  // 0 for bytes that appear in no pattern
+    int nclasses;
+    int nstates;
+    int has_suffix;
+    uint32_t *delta;          // [state * nclasses + class] -> next state
+    MatchOut *out;
+} Matcher;
+
+typedef struct {
+    const char *pattern;
+    MatchOut out;
+} MatcherPattern;
+
+typedef enum { RULE_KEYWORD, RULE_EXT, RULE_MIME } RuleKind;
 
 typedef struct {
-    char *url;
-    char *method;
-    char **params;
+    RuleKind kind;
+    const char *pattern;
+    Method method;
+    int priority;
+    int refine;
+} MethodRule;
+
+typedef struct {
+    const char *url;           // interned in the job's seen table
+    const uint32_t *param_ids; // ids in the job's param table
     int param_count;
+    Method method;
 } Endpoint;
 
-[[nodiscard]] const char *infer_method(const char *url, const char *mimetype);
-[[nodiscard]] int add_url(URLSet *set, const char *url);
+typedef enum { SORT_ASC, SORT_DESC, SORT_NONE } SortOrder;
+
+typedef enum { FORMAT_JSON, FORMAT_NDJSON } OutputFormat;
+
+typedef enum { SHARD_NONE, SHARD_YEAR, SHARD_QUARTER } ShardUnit;
+
+// CDX from= and to= bounds: 1-14 digits of yyyyMMddhhmmss, "" when open.
+typedef struct {
+    char from[15];
+    char to[15];
+} TimeSlice;
+
+typedef struct {
+    const char *output_file;      // every domain into one file, "-" for stdout
+    const char *output_template;  // one file per domain instead, e.g. out/{domain}.json
+    int append;                   // append to output_file instead of truncating it
+    long limit;
+    long timeout;
+    int verbose;
+    SortOrder sort;
+    OutputFormat format;
+    int concurrency;
+    int page_concurrency;  // 0: follow the resumeKey chain, >0: paged mode
+    const TimeSlice *slices;  // time range of the query; several with --shard
+    int slice_count;
+    int slice_concurrency;    // --shard: slices of one domain in flight, each its own chain
+    const char *rules_file;
+    int retries;           // retries of a failed request before its page is given up
+    const char *checkpoint_dir;  // per-domain journals to resume killed runs from
+    const char *state_dir;       // per-domain endpoints and newest capture, kept across runs
+    double rate;           // requests per second over the whole run, 0: unlimited
+    long long byte_rate;   // bytes per second over the whole run, 0: unlimited
+    int compact;           // one endpoint object per line instead of indented
+    int cdx_text;          // fetch the CDX text output instead of output=json
+    const char *cdx_filters;  // "&filter=..." for every row query, already escaped
+    const char *query_scope;  // --state-dir: time range and filters of the run, "" for everything
+    const char *cdx_url;      // CDX server endpoint, CDX_ENDPOINT unless --cdx-url
+    int stats;                // time the stages and print a summary per domain and run
+    const char *stats_file;   // the same summary as JSON
+    const char *trace_file;   // Chrome trace-event JSON of requests, parsing and output
+    int threads;              // parser threads behind the event loop, 0 to parse inline
+} Options;
+
+// --stats counters of one domain, or summed over the run. Times are in ns;
+// request time is per request, so with several in flight it exceeds the wall
+// time, and parsing overlaps it.
+typedef struct {
+    long requests;         // sent, retries and throttled attempts included
+    long pages;            // complete row replies
+    long long bytes;       // received, as sent by the server (compressed)
+    long long body_bytes;  // fed to the parser, decompressed
+    long rows;             // capture rows parsed
+    long duplicates;       // rows whose URL was already known
+    long endpoints;
+    long long request_ns;
+    long long parse_ns;    // tokenizing, without the stages below
+    long long dedup_ns;    // add_url()
+    long long classify_ns; // method inference, parameters, progress lines
+    long long sort_ns;
+    long long serialize_ns;
+} Stats;
+
+typedef enum {
+    CDX_START,  // before the outer '['
+    CDX_ROWS,   // inside the outer array, between rows
+    CDX_DONE,
+    CDX_ERROR
+} CdxState;
+
+// A value inside a row. ptr is NULL for non-string values (null, numbers).
+typedef struct {
+    const char *ptr;
+    size_t len;
+} CdxField;
+
+typedef void (*CdxRowFn)(void *userp, long row, const CdxField *fields, int nfields);
+
+// Parser specialised for the CDX output=json shape, an array of arrays of
+// strings, or for the text output (see cdx_parse_text()). Rows are handed
+// out as spans into the bytes curl just delivered; only a row split across
+// two deliveries is copied (into carry), and only strings containing a
+// backslash are unescaped (into scratch).
+typedef struct {
+    CdxState state;
+    int expect_row;  // a ',' was seen and another row must follow
+    long row;
+    char *carry;
+    size_t carry_len;
+    size_t carry_cap;
+    char *scratch;
+    size_t scratch_cap;
+    size_t total;    // bytes fed so far
+    int text;        // the space-separated text output instead of JSON
+    char error[64];
+    CdxRowFn on_row;
+    void *userp;
+} CdxParser;
+
+typedef struct Pipeline Pipeline;
+
+// Buffered JSON serializer writing straight to a FILE. Strings are escaped
+// in place with ASCII-only output, matching jansson's JSON_ENSURE_ASCII.
+typedef struct {
+    Pipeline *pipe;  // --threads: full buffers go to the writer thread instead
+    FILE *fp;
+    char *buf;
+    size_t len;
+    size_t cap;
+    int compact;
+    OutputFormat format;
+    long count;  // endpoints written so far
+} JsonWriter;
+
+typedef struct DomainJob DomainJob;
+
+typedef enum {
+    REQ_CHAIN,      // next page of the resumeKey chain
+    REQ_NUM_PAGES,  // showNumPages probe for paged mode
+    REQ_PAGE        // one numbered page in paged mode
+} RequestKind;
+
+// One CDX request, queued for the scheduler or in flight; bound to its easy
+// handle through CURLOPT_PRIVATE.
+typedef struct Transfer {
+    CURL *curl;
+    DomainJob *job;
+    MemoryChunk chunk;        // showNumPages reply
+    CdxParser parser;         // rows of every other request
+    int saw_blank_row;        // the [] separator before the resumeKey row
+    RequestKind kind;
+    long page;                // REQ_PAGE: page number; REQ_CHAIN: time slice
+    long status;              // HTTP status, 0 until the first body bytes
+    int attempts;             // throttled (429/503) replies so far
+    int retries;              // failed attempts retried so far
+    long long retry_at;       // CLOCK_MONOTONIC ms, while waiting in the delayed list
+    long long sent_ns;        // --trace: when the scheduler handed it to curl
+
+    // --threads: from the first delivery handed to a parser thread until its
+    // end-of-transfer batch comes back, parser and saw_blank_row belong to
+    // that thread and the event loop only reads the fields below.
+    int lane;                 // parser thread of this transfer
+    int fed;                  // deliveries handed over since the last reset
+    int pend_ok;              // handle_done() verdict, completed by the parse result
+    int pend_transient;
+    int pend_page;            // held: the finish_page() verdict complete_transfer() was called with
+    int pend_end;             // the end marker is still waiting for room in the lane
+    atomic_int parse_failed;  // set by the parser thread; the next delivery aborts
+    struct RowBatch *batch;   // rows parsed from the current delivery
+    long long parse_ns;       // parser-side --stats, added to the job's on completion
+    long long classify_ns;
+    struct Transfer *next_paused;
+    int paused;               // on the pipeline's paused list
+    // Chain mode under --threads, double buffering: the moment a parser thread
+    // finds the page's resumeKey, the next page goes out on the partner while
+    // the event loop is still taking this page's rows.
+    struct Transfer *partner;
+    char *prefetched;         // the key partner was started with, journaled once this page is done
+    int busy;                 // from reset_transfer() until complete_transfer()
+    unsigned attempt;         // bumped by reset_transfer(), tags the keys sent on the side
+    int held;                 // --checkpoint: completed, waiting for the partner's key to be journaled
+    char url[MAX_URL_LEN];
+    struct Transfer *next_ready;
+} Transfer;
+
+// Per-domain pagination state. In chain mode every time slice of the query
+// (just one without --shard) walks its own resumeKey chain, up to
+// transfer_count slices at once; in paged mode up to transfer_count pages are
+// in flight.
+struct DomainJob {
+    char domain[MAX_DOMAIN_LEN + 1];
+    char full_domain[MAX_DOMAIN_LEN + 8];
+    char **resume_keys;        // per slice, NULL at the start of a chain
+    unsigned char *slice_done; // chain mode: slices already finished
+    long next_slice;
+    long num_pages;
+    long next_page;
+    int inflight;
+    Arena arena;               // URLs, parameter names and id lists of this domain
+    InternTable seen;
+    InternTable params;
+    Endpoint *endpoints;
+    int endpoint_count;
+    int endpoint_capacity;
+    JsonWriter *stream;        // NDJSON unsorted: endpoints go here as they are found
+    JsonWriter out;            // this domain's file under --output-template
+    char output_path[MAX_LINE_LEN];
+    int quiet;                 // the output is stdout, so no progress lines there
+    int failed;                // a request was lost, the output is incomplete
+
+    // --checkpoint: records since the last page boundary, in memory until
+    // journal_commit() appends them to journal_path.
+    JsonWriter journal;
+    char *journal_buf;
+    size_t journal_size;
+    char journal_path[MAX_LINE_LEN];
+    unsigned char *page_done;  // paged mode: pages already in the journal
+
+    // --state-dir: every endpoint found so far, appended as it is found, and
+    // the newest capture timestamp of the last complete run.
+    JsonWriter state;
+    char state_path[MAX_LINE_LEN];
+    char since[15];            // from= of this run, "" on the first one
+    char newest[15];           // newest capture timestamp seen so far
+
+    Pipeline *pipe;            // --threads: deliveries are parsed on the parser threads
+    JsonWriter *progress;      // --threads: progress lines are buffered here
+    atomic_int keys_queued;    // --threads: resumeKeys on the side queue, which point into the job
+    int finishing;             // finish_job() waits for keys_queued to drop to zero
+    int timed;                 // --stats or --trace: clock the stages, not just count
+    Stats stats;
+    long long trace_start_ns;  // --trace: when the domain was started
+    int resumed_done;          // the journal says the domain was finished
+    Transfer *transfers;
+    int transfer_count;
+    int partner_count;         // transfers[transfer_count + i] is the partner of transfers[i]
+};
+
+// Single curl_multi driven by epoll; keeps up to opts->concurrency jobs in flight.
+// Easy handles and everything they cache live as long as the loop, so a batch
+// of domains pays DNS, TCP and TLS setup once, not once per domain.
+typedef struct {
+    CURLM *multi;
+    int epfd;
+    long long timer_deadline;  // CLOCK_MONOTONIC ms, -1 when curl wants no timeout
+    const Options *opts;
+    CURLSH *share;             // DNS cache, connections and TLS sessions of the whole run
+    CURL **idle_handles;       // easy handles of finished jobs, kept for the next ones
+    int idle_count;
+    int idle_capacity;
+    JsonWriter out;            // the whole run's output, unless per-domain files are used
+    Pipeline *pipe;            // --threads
+    int next_lane;             // --threads: transfers go round robin over the parser threads
+    JsonWriter progress;       // --threads: progress lines, written out once per wakeup
+    int active;
+    int failed;
+    Stats total;               // --stats: every finished domain
+    json_t *stats_domains;     // --stats-file: one object per finished domain
+
+    // Request scheduler: every prepared request waits in the ready queue
+    // until the AIMD window, both token buckets and any Retry-After pause
+    // allow it to be handed to curl.
+    Transfer *ready_head;
+    Transfer *ready_tail;
+    Transfer *delayed;         // failed requests waiting out their backoff, unordered
+    uint64_t rng;              // backoff jitter
+    int running;               // requests handed to curl
+    double window;             // AIMD limit on running
+    int max_window;
+    double tokens;             // request bucket, opts->rate per second
+    double byte_tokens;        // bandwidth bucket; goes negative after a large reply
+    long long refill_ms;
+    long long paused_until;    // CLOCK_MONOTONIC ms; nothing is dispatched before it
+    long long last_decrease;
+    long long dispatch_deadline;  // when a blocked queue can move again, -1 if not blocked
+} EventLoop;
+
+typedef struct {
+    const char *single;  // domain from argv, NULL to read lines from stdin
+    int done;
+} DomainSource;
+
+[[nodiscard]] int method_rules_init(const char *rules_file);
+[[nodiscard]] Method infer_method(const char *url, size_t url_len, const char *mimetype, size_t mime_len);
+[[nodiscard]] int intern(InternTable *t, const char *s, size_t len, int *added);
+[[nodiscard]] int add_url(InternTable *seen, const char *url, size_t len, const char **stored);
+void free_intern_table(InternTable *t);
 void print_help(const char *prog_name);
 int compare_endpoints_asc(const void *a, const void *b);
 int compare_endpoints_desc(const void *a, const void *b);
-void free_endpoint(Endpoint *e);
-[[nodiscard]] int process_domain(const char *domain, const char *output_file, long limit, long timeout, int verbose, int sort_desc);
+[[nodiscard]] int process_domains(DomainSource *src, const Options *opts);
 static void safe_strcpy(char *dest, const char *src, size_t dest_size);
 static size_t safe_strncpy(char *dest, const char *src, size_t dest_size);
-static char *safe_strtok(char *str, const char *delim, char **saveptr);
 
 void print_help(const char *prog_name) {
     printf(
-"Usage: %s [OPTIONS] [domain]\n"
+"Usage: %s [OPTIONS] [domain] [year]\n"
 "       cat domains.txt | %s [OPTIONS]\n"
 "\n"
 "Recon tool that queries the Internet Archive CDX Server and outputs\n"
@@ -70,20 +446,75 @@ void print_help(const char *prog_name) {
 "Input:\n"
 "  domain                Target domain (e.g., example.com)\n"
 "  -                     Read domains from stdin (pipe)\n"
+"  year                  Only captures from that year, e.g. 2024; * for all\n"
 "\n"
 "Options:\n"
 "  -h, --help            Show this help message and exit\n"
-"  -o, --output FILE     Output JSON file (default: endpoints.json)\n"
+"  -o, --output FILE     Output file for all domains, - for stdout\n"
+"                        (default: endpoints.json)\n"
+"  -O, --output-template TPL\n"
+"                        One output file per domain, e.g. out/{domain}.json;\n"
+"                        missing directories are created\n"
+"  -a, --append          Append to the --output file instead of truncating it\n"
+"                        (ndjson only)\n"
 "  -l, --limit N         Max results per query (1150000, default: 100000)\n"
 "  -t, --timeout SEC     Curl timeout in seconds (default: 60)\n"
 "  -v, --verbose         Show query URLs\n"
-"  -s, --sort ORDER      Sort order: asc (default), desc\n"
+"  -s, --sort ORDER      Sort order: asc (default), desc, none\n"
+"  -f, --format FMT      json (default): one array holding the endpoints of\n"
+"                        every domain (per file with -O); ndjson: one\n"
+"                        endpoint per line, written as soon as it is found\n"
+"                        with --sort none, else as each domain finishes\n"
+"  -C, --compact         Write one compact object per line instead of indenting\n"
+"      --cdx-output FMT  CDX response format: json (default) or text, which is\n"
+"                        smaller on the wire and cheaper to parse\n"
+"      --cdx-url URL     CDX server to query (default: " CDX_ENDPOINT ")\n"
+"  -c, --concurrency N   Domains fetched in parallel (1-1024, default: 1)\n"
+"  -j, --threads N       Parse on N threads next to the network loop, and write\n"
+"                        output on another (0-64, default: 0, parse inline);\n"
+"                        a resumeKey chain then fetches its next page while\n"
+"                        the rows of the current one are still being taken\n"
+"  -P, --pages N         Paged mode: ask for showNumPages, then fetch N pages\n"
+"                        of each domain at once (1-64, default: resumeKey chain);\n"
+"                        with --shard, N time slices at once (default: 4)\n"
+"      --from TS         Only captures from TS on (yyyyMMddhhmmss, any prefix)\n"
+"      --to TS           Only captures up to TS, e.g. 2024 or 202406\n"
+"      --shard UNIT      Split the time range into year or quarter slices, each\n"
+"                        fetched as its own resumeKey chain and merged\n"
+"      --retries N       Retries of a failed page, with jittered exponential\n"
+"                        backoff (default: 5)\n"
+"      --checkpoint DIR  Journal progress per domain under DIR; a rerun resumes\n"
+"                        every domain from its last finished page\n"
+"      --state-dir DIR   Keep every domain's endpoints and newest capture under DIR;\n"
+"                        later runs only fetch newer captures and merge them in\n"
+"      --stats           Print bytes, pages, rows, duplicates, time per stage and\n"
+"                        peak RSS to stderr for each domain and the whole run\n"
+"      --stats-file FILE Also write them to FILE as JSON (implies --stats)\n"
+"      --trace FILE      Record request, parse, sort and write spans to FILE as\n"
+"                        Chrome trace JSON (chrome://tracing, ui.perfetto.dev)\n"
+"  -R, --rate N          Max CDX requests per second over the whole run\n"
+"  -B, --bandwidth N     Max bytes per second over the whole run (K/M/G suffixes)\n"
+"      --status CODES    Only fetch captures with these status codes, e.g. 200,301\n"
+"                        or 2..; a leading ! excludes them instead (repeatable)\n"
+"      --mime TYPES      Same for mimetypes, e.g. '!image/.*' (repeatable)\n"
+"      --exclude-regex RE\n"
+"                        Skip captures whose URL matches RE (repeatable)\n"
+"                        Filters are applied by the CDX server, before transfer\n"
+"  -r, --rules FILE      Method-inference rules replacing the built-in ones, one per\n"
+"                        line: <keyword|ext|mime> <pattern> <METHOD> [priority] [refine]\n"
 "\n"
 "Examples:\n"
 "  %s example.com\n"
+"  %s example.com 2024\n"
+"  %s --shard year -P 8 huge-target.com\n"
 "  echo \"google.com\" | %s\n"
 "  cat domains.txt | %s -o all.json\n"
+"  cat domains.txt | %s -c 16 -O out/{domain}.json\n"
+"  cat domains.txt | %s -c 32\n"
 "  %s -s desc target.com\n"
+"  cat domains.txt | %s -f ndjson -s none -o - | httpx\n"
+"  %s --status 200 --mime '!image/.*' --exclude-regex '.*\\.(css|woff2?)' target.com\n"
+"  cat domains.txt | %s -c 32 --stats-file stats.json\n"
 "\n"
 "Output (endpoints.json):\n"
 "  [\n"
@@ -93,7 +524,8 @@ void print_help(const char *prog_name) {
 "\n"
 "Source: https://archive.org/developers/wayback-cdx-server.html\n"
 "Version: 1.9.12 (C23)\n",
-        prog_name, prog_name, prog_name, prog_name, prog_name, prog_name
+        prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name,
+        prog_name, prog_name, prog_name
     );
 }
 
@@ -115,41 +547,433 @@ static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, voi
     return realsize;
 }
 
-[[nodiscard]] int add_url(URLSet *set, const char *url) {
-    if (!url || url[0] == '\0') return 0;
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Word-at-a-time multiplicative hash; never returns 0 (the empty-slot marker).
+static uint64_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0x100000001b3ULL);
+    while (len >= 8) {
+        uint64_t k;
+        memcpy(&k, s, 8);
+        h = (h ^ mix64(k)) * 0x9fb21c651e98df25ULL;
+        s += 8;
+        len -= 8;
+    }
+    uint64_t k = 0;
+    memcpy(&k, s, len);
+    h = mix64(h ^ k);
+    return h ? h : 1;
+}
+
+// align must be a power of two no larger than alignof(max_align_t).
+static void *arena_alloc(Arena *a, size_t size, size_t align) {
+    ArenaBlock *b = a->head;
+    size_t at = b ? (b->used + align - 1) & ~(align - 1) : 0;
+
+    if (!b || at + size > b->cap) {
+        // Oversized requests get a block of their own behind the current one,
+        // so the space left in the current block is not abandoned.
+        const int dedicated = b && size > ARENA_BLOCK_SIZE / 4;
+        const size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *nb = malloc(sizeof *nb + (dedicated ? size : cap));
+        if (!nb) { perror("malloc"); exit(EXIT_FAILURE); }
+        nb->cap = dedicated ? size : cap;
+        nb->used = size;
+        if (dedicated) {
+            nb->next = b->next;
+            b->next = nb;
+        } else {
+            nb->next = b;
+            a->head = nb;
+        }
+        return nb->data;
+    }
+    b->used = at + size;
+    return b->data + at;
+}
+
+static char *arena_strndup(Arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1, 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+static void arena_free(Arena *a) {
+    ArenaBlock *b = a->head;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+}
+
+static void intern_grow(InternTable *t) {
+    const size_t new_slots = t->slot_mask ? (t->slot_mask + 1) * 2 : INITIAL_CAPACITY * 2;
+    uint64_t *hashes = calloc(new_slots, sizeof *hashes);
+    uint32_t *index = malloc(new_slots * sizeof *index);
+    if (!hashes || !index) { perror("calloc"); exit(EXIT_FAILURE); }
+
+    const size_t mask = new_slots - 1;
+    if (t->slot_mask) {
+        for (size_t i = 0; i <= t->slot_mask; ++i) {
+            if (!t->slot_hash[i]) continue;
+            size_t j = t->slot_hash[i] & mask;
+            while (hashes[j]) j = (j + 1) & mask;
+            hashes[j] = t->slot_hash[i];
+            index[j] = t->slot_index[i];
+        }
+    }
+    free(t->slot_hash);
+    free(t->slot_index);
+    t->slot_hash = hashes;
+    t->slot_index = index;
+    t->slot_mask = mask;
+}
+
+// Returns the id of s, copying it into the arena first if it is new.
+[[nodiscard]] int intern(InternTable *t, const char *s, size_t len, int *added) {
+    // Keep the load factor at or below 1/2 so probe runs stay short.
+    if (((size_t)t->count + 1) * 2 > t->slot_mask + 1) intern_grow(t);
+
+    const uint64_t h = hash_bytes(s, len);
+    size_t i = h & t->slot_mask;
+    while (t->slot_hash[i]) {
+        const uint32_t id = t->slot_index[i];
+        if (t->slot_hash[i] == h && t->lens[id] == len && memcmp(t->strs[id], s, len) == 0) {
+            if (added) *added = 0;
+            return (int)id;
+        }
+        i = (i + 1) & t->slot_mask;
+    }
+
+    if (t->count == t->capacity) {
+        t->capacity = max(t->capacity * 2, INITIAL_CAPACITY);
+        const char **strs = realloc(t->strs, t->capacity * sizeof *strs);
+        uint32_t *lens = realloc(t->lens, t->capacity * sizeof *lens);
+        if (!strs || !lens) { perror("realloc"); exit(EXIT_FAILURE); }
+        t->strs = strs;
+        t->lens = lens;
+    }
+
+    const int id = t->count++;
+    t->strs[id] = arena_strndup(t->arena, s, len);
+    t->lens[id] = (uint32_t)len;
+    t->slot_hash[i] = h;
+    t->slot_index[i] = (uint32_t)id;
+    if (added) *added = 1;
+    return id;
+}
+
+// Adds url to the seen set. Returns 1 and its interned copy when it is new.
+[[nodiscard]] int add_url(InternTable *seen, const char *url, size_t len, const char **stored) {
+    if (!url || len == 0) return 0;
+    int added;
+    const int id = intern(seen, url, len, &added);
+    if (stored) *stored = seen->strs[id];
+    return added;
+}
+
+void free_intern_table(InternTable *t) {
+    free(t->strs);
+    free(t->lens);
+    free(t->slot_hash);
+    free(t->slot_index);
+    *t = (InternTable){ .arena = t->arena };
+}
+
+static inline void merge_out(MatchOut *dst, const MatchOut *src) {
+    if (src->any > dst->any) dst->any = src->any;
+    if (src->refine > dst->refine) dst->refine = src->refine;
+    if (src->suffix > dst->suffix) dst->suffix = src->suffix;
+}
+
+static void matcher_build(Matcher *m, const MatcherPattern *patterns, int n) {
+    *m = (Matcher){0};
+    m->nclasses = 1;
+    size_t total = 1;
+    for (int k = 0; k < n; ++k) {
+        for (const unsigned char *c = (const unsigned char *)patterns[k].pattern; *c; ++c) {
+            const unsigned char lo = (unsigned char)tolower(*c);
+            if (!m->byte_class[lo]) {
+                m->byte_class[lo] = (uint8_t)m->nclasses;
+                m->byte_class[toupper(lo)] = (uint8_t)m->nclasses;
+                ++m->nclasses;
+            }
+            ++total;
+        }
+        if (patterns[k].out.suffix) m->has_suffix = 1;
+    }
+
+    const size_t nc = (size_t)m->nclasses;
+    m->delta = malloc(total * nc * sizeof *m->delta);
+    m->out = calloc(total, sizeof *m->out);
+    uint32_t *fail = calloc(total, sizeof *fail);
+    uint32_t *queue = malloc(total * sizeof *queue);
+    if (!m->delta || !m->out || !fail || !queue) { perror("malloc"); exit(1); }
+    memset(m->delta, 0xFF, total * nc * sizeof *m->delta);  // UINT32_MAX: no trie edge yet
+
+    // Trie of the patterns.
+    m->nstates = 1;
+    for (int k = 0; k < n; ++k) {
+        uint32_t s = 0;
+        for (const unsigned char *c = (const unsigned char *)patterns[k].pattern; *c; ++c) {
+            uint32_t *edge = &m->delta[s * nc + m->byte_class[*c]];
+            if (*edge == UINT32_MAX) *edge = (uint32_t)m->nstates++;
+            s = *edge;
+        }
+        merge_out(&m->out[s], &patterns[k].out);
+    }
+
+    // Breadth-first: fill in failure transitions so every state has an edge
+    // for every class, and inherit the outputs of the failure state.
+    size_t head = 0, tail = 0;
+    for (size_t c = 0; c < nc; ++c) {
+        uint32_t *edge = &m->delta[c];
+        if (*edge == UINT32_MAX) *edge = 0;
+        else queue[tail++] = *edge;
+    }
+    while (head < tail) {
+        const uint32_t s = queue[head++];
+        for (size_t c = 0; c < nc; ++c) {
+            uint32_t *edge = &m->delta[s * nc + c];
+            const uint32_t via_fail = m->delta[fail[s] * nc + c];
+            if (*edge == UINT32_MAX) {
+                *edge = via_fail;
+            } else {
+                fail[*edge] = via_fail;
+                merge_out(&m->out[*edge], &m->out[via_fail]);
+                queue[tail++] = *edge;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+static void matcher_free(Matcher *m) {
+    free(m->delta);
+    free(m->out);
+    *m = (Matcher){0};
+}
 
-    for (int i = 0; i < set->count; ++i) {
-        if (strcmp(set->urls[i], url) == 0) return 0;
+// Best ranks over every pattern occurring in s, ignoring ASCII case. Suffix
+// patterns only count when they end where the path does (at '?', '#' or the end).
+static inline MatchOut matcher_scan(const Matcher *m, const char *s, size_t len) {
+    const size_t nc = (size_t)m->nclasses;
+    MatchOut found = {0};
+    uint32_t state = 0;
+    size_t path_end = m->has_suffix ? len : 0;
+
+    if (m->has_suffix) {
+        const char *q = memchr(s, '?', len);
+        const char *h = memchr(s, '#', q ? (size_t)(q - s) : len);
+        if (h) q = h;
+        if (q) path_end = (size_t)(q - s);
+        if (path_end == 0) found.suffix = m->out[0].suffix;
     }
+    for (size_t i = 0; i < len; ++i) {
+        state = m->delta[state * nc + m->byte_class[(unsigned char)s[i]]];
+        const MatchOut *o = &m->out[state];
+        if (o->any > found.any) found.any = o->any;
+        if (o->refine > found.refine) found.refine = o->refine;
+        if (i + 1 == path_end) found.suffix = o->suffix;
+    }
+    return found;
+}
+
+// The built-in heuristics: a body keyword means POST, refined to PUT by
+// update/patch and to DELETE by delete/remove.
+static const MethodRule default_rules[] = {
+    { RULE_KEYWORD, "update", METHOD_PUT, 30, 0 },
+    { RULE_KEYWORD, "patch", METHOD_PUT, 30, 1 },
+    { RULE_KEYWORD, "delete", METHOD_DELETE, 20, 0 },
+    { RULE_KEYWORD, "remove", METHOD_DELETE, 20, 1 },
+    { RULE_KEYWORD, "login", METHOD_POST, 10, 0 },
+    { RULE_KEYWORD, "submit", METHOD_POST, 10, 0 },
+    { RULE_KEYWORD, "upload", METHOD_POST, 10, 0 },
+    { RULE_KEYWORD, "create", METHOD_POST, 10, 0 },
+    { RULE_KEYWORD, "api", METHOD_POST, 10, 0 },
+    { RULE_KEYWORD, "json", METHOD_POST, 10, 0 },
+    { RULE_KEYWORD, "graphql", METHOD_POST, 10, 0 },
+    { RULE_MIME, "json", METHOD_POST, 10, 0 },
+    { RULE_MIME, "xml", METHOD_POST, 10, 0 },
+    { RULE_MIME, "form", METHOD_POST, 10, 0 },
+};
+
+static Matcher url_matcher, mime_matcher;
+static Method *rank_method;  // rank -> method; rank 0 is unused
+
+static int compare_rule_priority(const void *a, const void *b) {
+    const MethodRule *ra = *(const MethodRule *const *)a;
+    const MethodRule *rb = *(const MethodRule *const *)b;
+    if (ra->priority != rb->priority) return ra->priority > rb->priority ? -1 : 1;
+    return ra < rb ? -1 : ra > rb;  // earlier rule wins a tie
+}
 
-    if (set->count == set->capacity) {
-        set->capacity = max(set->capacity * 2, INITIAL_CAPACITY);
-        char **new_urls = realloc(set->urls, set->capacity * sizeof *new_urls);
-        if (!new_urls) { perror("realloc"); exit(EXIT_FAILURE); }
-        set->urls = new_urls;
+static void compile_rules(const MethodRule *rules, int n) {
+    // Rank 1..n from lowest to highest priority so the matchers can merge by max.
+    const MethodRule **order = calloc((size_t)n + 1, sizeof *order);
+    MatcherPattern *url_patterns = calloc((size_t)n + 1, sizeof *url_patterns);
+    MatcherPattern *mime_patterns = calloc((size_t)n + 1, sizeof *mime_patterns);
+    free(rank_method);
+    rank_method = calloc((size_t)n + 1, sizeof *rank_method);
+    if (!order || !url_patterns || !mime_patterns || !rank_method) { perror("calloc"); exit(1); }
+
+    for (int i = 0; i < n; ++i) order[i] = &rules[i];
+    qsort(order, (size_t)n, sizeof *order, compare_rule_priority);
+
+    int nurl = 0, nmime = 0;
+    for (int i = 0; i < n; ++i) {
+        const MethodRule *r = order[i];
+        const uint32_t rank = (uint32_t)(n - i);
+        rank_method[rank] = r->method;
+
+        MatcherPattern *p = r->kind == RULE_MIME ? &mime_patterns[nmime++] : &url_patterns[nurl++];
+        *p = (MatcherPattern){ .pattern = r->pattern };
+        if (r->kind == RULE_EXT) p->out.suffix = rank;
+        else if (r->refine) p->out.refine = rank;
+        else p->out.any = rank;
     }
 
-    set->urls[set->count] = strdup(url);
-    if (!set->urls[set->count]) { perror("strdup"); exit(EXIT_FAILURE); }
-    ++set->count;
+    matcher_free(&url_matcher);
+    matcher_free(&mime_matcher);
+    matcher_build(&url_matcher, url_patterns, nurl);
+    matcher_build(&mime_matcher, mime_patterns, nmime);
+    free(order);
+    free(url_patterns);
+    free(mime_patterns);
+}
+
+static int parse_method(const char *s, Method *out) {
+    for (int m = 0; m < METHOD_COUNT; ++m) {
+        if (strcasecmp(s, method_names[m]) == 0) { *out = (Method)m; return 0; }
+    }
     return 1;
 }
 
-[[nodiscard]] const char *infer_method(const char *url, const char *mimetype) {
-    if (!url) return "GET";
-    const char *m = mimetype ? mimetype : "";
+// Rules file: one rule per line, '#' starts a comment.
+//   <keyword|ext|mime> <pattern> <METHOD> [priority] [refine]
+static int load_rules(const char *path, MethodRule **out, int *count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) { perror(path); return 1; }
+
+    MethodRule *rules = NULL;
+    int n = 0, cap = 0, lineno = 0, err = 0;
+    char line[MAX_LINE_LEN];
+    while (!err && fgets(line, sizeof(line), fp)) {
+        ++lineno;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char *saveptr = NULL;
+        char *kind = strtok_r(line, " \t", &saveptr);
+        if (!kind) continue;
+        char *pattern = strtok_r(NULL, " \t", &saveptr);
+        char *method = strtok_r(NULL, " \t", &saveptr);
+        char *priority = strtok_r(NULL, " \t", &saveptr);
+        char *flag = strtok_r(NULL, " \t", &saveptr);
+        // The priority is optional, so "refine" may come right after the method.
+        if (priority && !flag && strcmp(priority, "refine") == 0) {
+            flag = priority;
+            priority = NULL;
+        }
+
+        MethodRule r = {0};
+        char *end = NULL;
+        if (strcmp(kind, "keyword") == 0) r.kind = RULE_KEYWORD;
+        else if (strcmp(kind, "ext") == 0) r.kind = RULE_EXT;
+        else if (strcmp(kind, "mime") == 0) r.kind = RULE_MIME;
+        else { fprintf(stderr, "%s:%d: unknown rule kind '%s'\n", path, lineno, kind); err = 1; break; }
+
+        if (!pattern || !method) {
+            fprintf(stderr, "%s:%d: expected <kind> <pattern> <METHOD> [priority] [refine]\n", path, lineno);
+            err = 1;
+        } else if (parse_method(method, &r.method) != 0) {
+            fprintf(stderr, "%s:%d: unknown method '%s'\n", path, lineno, method);
+            err = 1;
+        } else if (priority && ((r.priority = (int)strtol(priority, &end, 10)), *end != '\0')) {
+            fprintf(stderr, "%s:%d: priority must be an integer: <kind> <pattern> <METHOD> [priority] [refine]\n",
+                    path, lineno);
+            err = 1;
+        } else if (flag && strcmp(flag, "refine") != 0) {
+            fprintf(stderr, "%s:%d: unknown flag '%s'\n", path, lineno, flag);
+            err = 1;
+        } else if (flag && r.kind == RULE_EXT) {
+            fprintf(stderr, "%s:%d: only keyword and mime rules take 'refine'\n", path, lineno);
+            err = 1;
+        } else if (strtok_r(NULL, " \t", &saveptr)) {
+            fprintf(stderr, "%s:%d: trailing text after rule\n", path, lineno);
+            err = 1;
+        }
+        if (err) break;
+        r.refine = flag != NULL;
+
+        // Extensions are matched with their dot so "php" cannot hit "/phpinfo".
+        const int add_dot = r.kind == RULE_EXT && pattern[0] != '.';
+        char *copy = malloc(strlen(pattern) + 2);
+        if (!copy) { perror("malloc"); exit(1); }
+        snprintf(copy, strlen(pattern) + 2, "%s%s", add_dot ? "." : "", pattern);
+        r.pattern = copy;
+
+        if (n == cap) {
+            cap = max(cap * 2, 64);
+            MethodRule *grown = realloc(rules, (size_t)cap * sizeof *rules);
+            if (!grown) { perror("realloc"); exit(1); }
+            rules = grown;
+        }
+        rules[n++] = r;
+    }
+    fclose(fp);
+
+    if (err) {
+        for (int i = 0; i < n; ++i) free((char *)rules[i].pattern);
+        free(rules);
+        return 1;
+    }
+    *out = rules;
+    *count = n;
+    return 0;
+}
+
+// Compiles the method-inference rules: the built-in heuristics, or the rules
+// in rules_file instead when one is given. Call once before infer_method().
+[[nodiscard]] int method_rules_init(const char *rules_file) {
+    if (!rules_file) {
+        compile_rules(default_rules, sizeof default_rules / sizeof *default_rules);
+        return 0;
+    }
+
+    MethodRule *rules = NULL;
+    int n = 0;
+    if (load_rules(rules_file, &rules, &n) != 0) return 1;
+    compile_rules(rules, n);
+    for (int i = 0; i < n; ++i) free((char *)rules[i].pattern);
+    free(rules);
+    return 0;
+}
 
-    int has_post = strstr(url, "login") || strstr(url, "submit") || strstr(url, "upload") ||
-                   strstr(url, "create") || strstr(url, "update") || strstr(url, "delete") ||
-                   strstr(url, "api") || strstr(url, "json") || strstr(url, "graphql") ||
-                   strstr(m, "json") || strstr(m, "xml") || strstr(m, "form");
+[[nodiscard]] Method infer_method(const char *url, size_t url_len, const char *mimetype, size_t mime_len) {
+    if (!url) return METHOD_GET;
 
-    if (has_post) {
-        if (strstr(url, "update") || strstr(url, "patch")) return "PUT";
-        if (strstr(url, "delete") || strstr(url, "remove")) return "DELETE";
-        return "POST";
+    MatchOut hit = matcher_scan(&url_matcher, url, url_len);
+    if (mimetype) {
+        MatchOut mime = matcher_scan(&mime_matcher, mimetype, mime_len);
+        if (mime.any > hit.any) hit.any = mime.any;
+        if (mime.refine > hit.refine) hit.refine = mime.refine;
     }
-    return "GET";
+
+    uint32_t best = hit.any > hit.suffix ? hit.any : hit.suffix;
+    if (best == 0) return METHOD_GET;
+    if (hit.refine > best) best = hit.refine;
+    return rank_method[best];
 }
 
 int compare_endpoints_asc(const void *a, const void *b) {
@@ -164,13 +988,6 @@ int compare_endpoints_desc(const void *a, const void *b) {
     return strcmp(eb->url, ea->url);
 }
 
-void free_endpoint(Endpoint *e) {
-    free(e->url);
-    free(e->method);
-    for (int i = 0; i < e->param_count; ++i) free(e->params[i]);
-    if (e->params) free(e->params);
-}
-
 static void safe_strcpy(char *dest, const char *src, size_t dest_size) {
     size_t i = 0;
     while (i < dest_size - 1 && src[i]) {
@@ -190,292 +1007,2814 @@ static size_t safe_strncpy(char *dest, const char *src, size_t dest_size) {
     return i;
 }
 
-static char *safe_strtok(char *str, const char *delim, char **saveptr) {
-    if (!str) str = *saveptr;
-    if (!str || *str == '\0') return NULL;
-    str += strspn(str, delim);
-    if (*str == '\0') return NULL;
-    char *end = str + strcspn(str, delim);
-    if (*end != '\0') *end++ = '\0';
-    *saveptr = end;
-    return str;
+static void cdx_parser_reset(CdxParser *p, CdxRowFn on_row, void *userp) {
+    p->state = CDX_START;
+    p->expect_row = 0;
+    p->row = 0;
+    p->carry_len = 0;
+    p->total = 0;
+    p->error[0] = '\0';
+    p->on_row = on_row;
+    p->userp = userp;
 }
 
-[[nodiscard]] int process_domain(const char *domain, const char *output_file, long limit, long timeout, int verbose, int sort_desc) {
-    if (!domain || domain[0] == '\0' || strlen(domain) > MAX_DOMAIN_LEN) {
-        fprintf(stderr, "Invalid domain: empty or too long\n");
-        return 1;
+static void cdx_parser_free(CdxParser *p) {
+    free(p->carry);
+    free(p->scratch);
+    p->carry = p->scratch = NULL;
+    p->carry_len = p->carry_cap = p->scratch_cap = 0;
+}
+
+static void grow_buffer(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return;
+    size_t new_cap = *cap ? *cap : MAX_URL_LEN;
+    while (new_cap < need) new_cap *= 2;
+    char *p = realloc(*buf, new_cap);
+    if (!p) { perror("realloc"); exit(1); }
+    *buf = p;
+    *cap = new_cap;
+}
+
+// First '"' or '\\' in [s, end), or end.
+static inline const char *scan_string_special(const char *s, const char *end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+        if (mask) return s + __builtin_ctz((unsigned)mask);
+        s += 16;
     }
+#endif
+    while (s < end && *s != '"' && *s != '\\') ++s;
+    return s;
+}
 
-    char full_domain[MAX_DOMAIN_LEN + 8];
-    if (strstr(domain, "://") == NULL) {
-        snprintf(full_domain, sizeof(full_domain), "http://%s", domain);
+static inline const char *skip_ws(const char *s, const char *end) {
+    while (s < end && (*s == ' ' || *s == '\n' || *s == '\r' || *s == '\t')) ++s;
+    return s;
+}
+
+static inline int is_literal_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'E';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static char *put_utf8(char *out, unsigned cp) {
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
     } else {
-        safe_strcpy(full_domain, domain, sizeof(full_domain));
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
     }
+    return out;
+}
 
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "curl_easy_init() failed\n");
-        return 1;
+static int read_hex4(const char *s, const char *end, unsigned *cp) {
+    if (end - s < 4) return -1;
+    unsigned v = 0;
+    for (int i = 0; i < 4; ++i) {
+        int h = hex_value(s[i]);
+        if (h < 0) return -1;
+        v = (v << 4) | (unsigned)h;
     }
+    *cp = v;
+    return 0;
+}
 
-    char *resume_key = NULL;
-    MemoryChunk chunk = {0};
-    URLSet seen = {0};
-
-    Endpoint *endpoints = NULL;
-    int endpoint_count = 0;
-    int endpoint_capacity = 0;
+// Decodes the escapes of a JSON string body. The output is never longer than
+// the input. Lone surrogates and \u0000 become U+FFFD. Returns the output
+// length, or -1 on an invalid escape.
+static long json_unescape(const char *s, size_t len, char *out) {
+    const char *end = s + len;
+    char *o = out;
+    while (s < end) {
+        if (*s != '\\') { *o++ = *s++; continue; }
+        if (++s == end) return -1;
+        const char c = *s++;
+        switch (c) {
+        case '"': case '\\': case '/': *o++ = c; break;
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'n': *o++ = '\n'; break;
+        case 'r': *o++ = '\r'; break;
+        case 't': *o++ = '\t'; break;
+        case 'u': {
+            unsigned cp;
+            if (read_hex4(s, end, &cp) != 0) return -1;
+            s += 4;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                unsigned lo;
+                if (end - s >= 6 && s[0] == '\\' && s[1] == 'u' && read_hex4(s + 2, end, &lo) == 0 &&
+                    lo >= 0xDC00 && lo <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    s += 6;
+                } else {
+                    cp = 0xFFFD;
+                }
+            } else if ((cp >= 0xDC00 && cp <= 0xDFFF) || cp == 0) {
+                cp = 0xFFFD;
+            }
+            o = put_utf8(o, cp);
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    return o - out;
+}
 
-    do {
-        char url[MAX_URL_LEN];
-        if (resume_key) {
-            snprintf(url, sizeof(url),
-                     "http://web.archive.org/cdx/search/cdx?"
-                     "url=%s&matchType=domain&fl=original,timestamp,statuscode,mimetype&"
-                     "collapse=urlkey&output=json&limit=%ld&resumeKey=%s",
-                     full_domain, limit, resume_key);
-            free(resume_key);
-            resume_key = NULL;
+typedef enum { ROW_OK, ROW_INCOMPLETE, ROW_ERROR } RowResult;
+
+// Tokenizes one row starting just after its '['. On ROW_OK *s points past the
+// closing ']'; on ROW_ERROR it points at the offending byte.
+static RowResult cdx_scan_row(const char **sp, const char *end, CdxField *fields,
+                              unsigned char *escaped, int *nfields) {
+    const char *s = skip_ws(*sp, end);
+    int n = 0;
+    if (s == end) return ROW_INCOMPLETE;
+    if (*s == ']') { *sp = s + 1; *nfields = 0; return ROW_OK; }
+
+    for (;;) {
+        s = skip_ws(s, end);
+        if (s == end) return ROW_INCOMPLETE;
+
+        CdxField f = {0};
+        unsigned char esc = 0;
+        if (*s == '"') {
+            const char *start = ++s;
+            for (;;) {
+                s = scan_string_special(s, end);
+                if (s == end) return ROW_INCOMPLETE;
+                if (*s == '"') break;
+                if (end - s < 2) return ROW_INCOMPLETE;
+                esc = 1;
+                s += 2;
+            }
+            f.ptr = start;
+            f.len = (size_t)(s - start);
+            ++s;
+        } else if (is_literal_char(*s)) {
+            while (s < end && is_literal_char(*s)) ++s;
+            if (s == end) return ROW_INCOMPLETE;
         } else {
-            snprintf(url, sizeof(url),
-                     "http://web.archive.org/cdx/search/cdx?"
-                     "url=%s&matchType=domain&fl=original,timestamp,statuscode,mimetype&"
-                     "collapse=urlkey&output=json&limit=%ld&showResumeKey=true",
-                     full_domain, limit);
+            *sp = s;
+            return ROW_ERROR;
         }
-
-        if (verbose) {
-            printf("Querying: %s\n", url);
-            fflush(stdout);
+        if (n < CDX_MAX_FIELDS) {
+            fields[n] = f;
+            escaped[n] = esc;
         }
+        ++n;
+
+        s = skip_ws(s, end);
+        if (s == end) return ROW_INCOMPLETE;
+        if (*s == ',') { ++s; continue; }
+        if (*s == ']') {
+            *sp = s + 1;
+            *nfields = n < CDX_MAX_FIELDS ? n : CDX_MAX_FIELDS;
+            return ROW_OK;
+        }
+        *sp = s;
+        return ROW_ERROR;
+    }
+}
 
-        chunk.data = NULL; chunk.size = 0;
+static void cdx_fail(CdxParser *p, const char *what, const char *at, const char *base, size_t base_offset) {
+    const char c = *at;
+    snprintf(p->error, sizeof(p->error), "%s '%c' at byte %zu", what,
+             (c >= 0x20 && c < 0x7F) ? c : '?', base_offset + (size_t)(at - base));
+    p->state = CDX_ERROR;
+}
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "WaybackRecon/1.9.12");
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+static int cdx_emit_row(CdxParser *p, CdxField *fields, const unsigned char *escaped, int n) {
+    size_t need = 0;
+    for (int i = 0; i < n; ++i) if (escaped[i]) need += fields[i].len;
+    if (need > 0) {
+        grow_buffer(&p->scratch, &p->scratch_cap, need);
+        char *out = p->scratch;
+        for (int i = 0; i < n; ++i) {
+            if (!escaped[i]) continue;
+            long len = json_unescape(fields[i].ptr, fields[i].len, out);
+            if (len < 0) return -1;
+            fields[i].ptr = out;
+            fields[i].len = (size_t)len;
+            out += len;
+        }
+    }
+    p->on_row(p->userp, p->row++, fields, n);
+    return 0;
+}
 
-        CURLcode res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl error for %s: %s\n", domain, curl_easy_strerror(res));
-            break;
+// Consumes complete rows from [base, end). Returns where it stopped: end, or
+// the '[' of a row that has not fully arrived yet.
+static const char *cdx_parse(CdxParser *p, const char *base, const char *end, size_t base_offset) {
+    const char *s = base;
+    while (p->state != CDX_ERROR) {
+        s = skip_ws(s, end);
+        if (s == end) break;
+
+        if (p->state == CDX_START) {
+            if (*s != '[') { cdx_fail(p, "expected '[' but got", s, base, base_offset); break; }
+            p->state = CDX_ROWS;
+            ++s;
+        } else if (p->state == CDX_ROWS) {
+            if (*s == '[' && (p->expect_row || p->row == 0)) {
+                CdxField fields[CDX_MAX_FIELDS];
+                unsigned char escaped[CDX_MAX_FIELDS];
+                int n = 0;
+                const char *row_end = s + 1;
+                RowResult r = cdx_scan_row(&row_end, end, fields, escaped, &n);
+                if (r == ROW_INCOMPLETE) return s;
+                if (r == ROW_ERROR) { cdx_fail(p, "unexpected", row_end, base, base_offset); break; }
+                if (cdx_emit_row(p, fields, escaped, n) != 0) {
+                    cdx_fail(p, "invalid escape in row near", s, base, base_offset);
+                    break;
+                }
+                p->expect_row = 0;
+                s = row_end;
+            } else if (*s == ',' && !p->expect_row && p->row > 0) {
+                p->expect_row = 1;
+                ++s;
+            } else if (*s == ']' && !p->expect_row) {
+                p->state = CDX_DONE;
+                ++s;
+            } else {
+                cdx_fail(p, "unexpected", s, base, base_offset);
+            }
+        } else {
+            cdx_fail(p, "trailing", s, base, base_offset);
         }
-        if (!chunk.data || chunk.size == 0) break;
+    }
+    return end;
+}
 
-        json_error_t error;
-        json_t *root = json_loads(chunk.data, 0, &error);
-        free(chunk.data); chunk.data = NULL;
+// One line of text output. Fields are spans into the line: the last three
+// tokens are timestamp, statuscode and mimetype, and everything before them is
+// the URL, so an unescaped space inside a URL survives.
+static void cdx_text_line(CdxParser *p, const char *s, const char *eol, const char *base, size_t base_offset) {
+    if (eol > s && eol[-1] == '\r') --eol;
+    if (p->state == CDX_START) {
+        p->state = CDX_ROWS;
+        p->row = 1;  // text output has no header row
+    }
+    if (p->state == CDX_DONE) {
+        if (eol > s) cdx_fail(p, "trailing", s, base, base_offset);
+        return;
+    }
+    if (eol == s) {  // the blank line before the resumeKey
+        if (!p->expect_row) p->on_row(p->userp, p->row++, NULL, 0);
+        p->expect_row = 1;
+        return;
+    }
+    if (p->expect_row) {
+        const CdxField key = { s, (size_t)(eol - s) };
+        p->on_row(p->userp, p->row++, &key, 1);
+        p->state = CDX_DONE;
+        return;
+    }
 
-        if (!root) {
-            fprintf(stderr, "JSON parse error for %s: %s\n", domain, error.text);
-            break;
-        }
-        if (!json_is_array(root) || json_array_size(root) < 2) {
-            json_decref(root);
-            break;
-        }
+    // The trailing fields are short, so walk back from the end instead of
+    // splitting the URL; only the line itself was found with memchr().
+    const char *cut[3];
+    const char *q = eol;
+    for (int i = 0; i < 3; ++i) {
+        while (q > s && q[-1] != ' ') --q;
+        if (q == s) { cdx_fail(p, "short line near", s, base, base_offset); return; }
+        cut[i] = --q;
+    }
+    const CdxField fields[4] = {
+        { s, (size_t)(cut[2] - s) },
+        { cut[2] + 1, (size_t)(cut[1] - cut[2] - 1) },
+        { cut[1] + 1, (size_t)(cut[0] - cut[1] - 1) },
+        { cut[0] + 1, (size_t)(eol - cut[0] - 1) },
+    };
+    // An HTML error page with a 200 status would otherwise pass for rows.
+    if (fields[1].len == 0 || fields[1].len > 14 || strspn(fields[1].ptr, "0123456789") < fields[1].len) {
+        cdx_fail(p, "no timestamp in line near", s, base, base_offset);
+        return;
+    }
+    p->on_row(p->userp, p->row++, fields, 4);
+}
 
-        for (size_t i = 1; i < json_array_size(root); ++i) {
-            json_t *row = json_array_get(root, i);
-            if (!json_is_array(row) || json_array_size(row) < 4) continue;
-
-            const char *original = json_string_value(json_array_get(row, 0));
-            const char *mimetype = json_string_value(json_array_get(row, 3));
-            if (!original) continue;
-
-            if (add_url(&seen, original)) {
-                const char *method = infer_method(original, mimetype);
-
-                char **params = NULL;
-                int param_count = 0;
-                const char *qmark = strchr(original, '?');
-                if (qmark) {
-                    char query[MAX_PARAM_LEN];
-                    safe_strncpy(query, qmark + 1, sizeof(query));
-
-                    char *saveptr = NULL;
-                    char *token = safe_strtok(query, "&", &saveptr);
-                    while (token) {
-                        char *eq = strchr(token, '=');
-                        if (eq) *eq = '\0';
-                        if (token[0] != '\0') {
-                            params = realloc(params, (param_count + 1) * sizeof *params);
-                            if (!params) { perror("realloc"); exit(1); }
-                            params[param_count++] = strdup(token);
-                            if (!params[param_count - 1]) { perror("strdup"); exit(1); }
-                        }
-                        token = safe_strtok(NULL, "&", &saveptr);
-                    }
-                }
+// Consumes complete lines of text output from [base, end): one
+// "original timestamp statuscode mimetype" line per capture, then, with
+// showResumeKey, a blank line and the key. Returns the start of a line that
+// has not fully arrived yet, or end.
+static const char *cdx_parse_text(CdxParser *p, const char *base, const char *end, size_t base_offset) {
+    const char *s = base;
+    while (p->state != CDX_ERROR && s < end) {
+        const char *nl = memchr(s, '\n', (size_t)(end - s));
+        if (!nl) return s;
+        cdx_text_line(p, s, nl, base, base_offset);
+        s = nl + 1;
+    }
+    return end;
+}
 
-                printf("%s | %s | ", original, method);
-                if (param_count == 0) printf("none\n");
-                else {
-                    for (int j = 0; j < param_count; ++j) {
-                        printf("%s%s", params[j], j < param_count - 1 ? ", " : "\n");
-                    }
-                }
-                fflush(stdout);
+// Called once the whole response has been fed. Text output has no closing
+// token, so its last line may still be waiting in carry.
+static void cdx_parser_finish(CdxParser *p) {
+    if (!p->text || p->state == CDX_ERROR) return;
+    if (p->carry_len > 0) {
+        cdx_text_line(p, p->carry, p->carry + p->carry_len, p->carry, p->total - p->carry_len);
+        p->carry_len = 0;
+    }
+    if (p->state == CDX_ROWS) p->state = CDX_DONE;
+}
 
-                if (endpoint_count == endpoint_capacity) {
-                    endpoint_capacity = max(endpoint_capacity * 2, INITIAL_CAPACITY);
-                    endpoints = realloc(endpoints, endpoint_capacity * sizeof *endpoints);
-                    if (!endpoints) { perror("realloc"); exit(1); }
-                }
+// Feeds the next piece of the response. Returns 0, or -1 once the input is
+// known not to be a CDX JSON array or text listing (p->error says why).
+static int cdx_parser_feed(CdxParser *p, const char *data, size_t size) {
+    if (p->state == CDX_ERROR) return -1;
+    const size_t offset = p->total;
+    p->total += size;
+
+    const char *base = data;
+    size_t len = size;
+    size_t base_offset = offset;
+    if (p->carry_len > 0) {
+        grow_buffer(&p->carry, &p->carry_cap, p->carry_len + size);
+        memcpy(p->carry + p->carry_len, data, size);
+        p->carry_len += size;
+        base = p->carry;
+        len = p->carry_len;
+        base_offset = p->total - p->carry_len;
+    }
 
-                endpoints[endpoint_count].url = strdup(original);
-                if (!endpoints[endpoint_count].url) { perror("strdup"); exit(1); }
-                endpoints[endpoint_count].method = strdup(method);
-                if (!endpoints[endpoint_count].method) { perror("strdup"); exit(1); }
-                endpoints[endpoint_count].params = params;
-                endpoints[endpoint_count].param_count = param_count;
-                ++endpoint_count;
-            }
+    const char *stop = p->text ? cdx_parse_text(p, base, base + len, base_offset)
+                               : cdx_parse(p, base, base + len, base_offset);
+    const size_t left = (size_t)(base + len - stop);
+    if (left > 0 && p->state != CDX_ERROR) {
+        if (base == p->carry) {
+            memmove(p->carry, stop, left);
+        } else {
+            grow_buffer(&p->carry, &p->carry_cap, left);
+            memcpy(p->carry, stop, left);
         }
+        p->carry_len = left;
+    } else {
+        p->carry_len = 0;
+    }
+    return p->state == CDX_ERROR ? -1 : 0;
+}
 
-        json_t *last_row = json_array_get(root, json_array_size(root) - 1);
-        if (json_is_array(last_row) && json_array_size(last_row) > 0) {
-            json_t *last_cell = json_array_get(last_row, json_array_size(last_row) - 1);
-            const char *key = json_string_value(last_cell);
-            if (key && key[0] != '\0' && strcmp(key, "null") != 0) {
-                resume_key = strdup(key);
-                if (!resume_key) { perror("strdup"); exit(1); }
-            }
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int next_domain(DomainSource *src, char *buf, size_t size) {
+    if (src->done) return 0;
+    if (src->single) {
+        safe_strcpy(buf, src->single, size);
+        src->done = 1;
+        return 1;
+    }
+
+    char line[MAX_LINE_LEN];
+    while (fgets(line, sizeof(line), stdin)) {
+        size_t len = strcspn(line, "\r\n");
+        if (len == 0) continue;
+        if (len > MAX_DOMAIN_LEN) {
+            fprintf(stderr, "Invalid domain: empty or too long\n");
+            continue;
         }
+        safe_strncpy(buf, line, len + 1 < size ? len + 1 : size);
+        return 1;
+    }
+    src->done = 1;
+    return 0;
+}
 
-        json_decref(root);
+// Timestamp bounds are prefixes of yyyyMMddhhmmss, so only the digits both
+// have are compared: "2024" neither precedes nor follows "20240512".
+static inline int timestamp_cmp(const char *a, const char *b) {
+    return strncmp(a, b, min((int)strlen(a), (int)strlen(b)));
+}
 
-    } while (resume_key);
+static void build_query_url(const Transfer *t, const Options *opts, char *url, size_t size) {
+    const DomainJob *job = t->job;
+    // Text is the server's default output.
+    const char *output = opts->cdx_text ? "" : "&output=json";
+    const char *filters = opts->cdx_filters ? opts->cdx_filters : "";
+    // Paged mode is never sharded, so its requests all use the one range.
+    const long slice = t->kind == REQ_CHAIN ? t->page : 0;
+    char range[48] = "";
+    if (slice < opts->slice_count) {
+        const TimeSlice *ts = &opts->slices[slice];
+        // --state-dir: nothing before the newest capture of the last run is new.
+        const char *from = job->since[0] && timestamp_cmp(job->since, ts->from) >= 0 ? job->since : ts->from;
+        snprintf(range, sizeof(range), "%s%s%s%s", from[0] ? "&from=" : "", from,
+                 ts->to[0] ? "&to=" : "", ts->to);
+    } else if (job->since[0]) {
+        snprintf(range, sizeof(range), "&from=%s", job->since);
+    }
 
-    curl_easy_cleanup(curl);
-    for (int i = 0; i < seen.count; ++i) free(seen.urls[i]);
-    if (seen.urls) free(seen.urls);
+    const char *endpoint = opts->cdx_url ? opts->cdx_url : CDX_ENDPOINT;
 
-    if (endpoint_count > 0) {
-        qsort(endpoints, endpoint_count, sizeof *endpoints,
-              sort_desc ? compare_endpoints_desc : compare_endpoints_asc);
+    if (t->kind == REQ_NUM_PAGES) {
+        snprintf(url, size,
+                 "%s?"
+                 "url=%s&matchType=domain%s&showNumPages=true",
+                 endpoint, job->full_domain, range);
+        return;
+    }
+    if (t->kind == REQ_PAGE) {
+        snprintf(url, size,
+                 "%s?"
+                 "url=%s&matchType=domain&fl=original,timestamp,statuscode,mimetype&"
+                 "collapse=urlkey%s%s%s&page=%ld",
+                 endpoint, job->full_domain, output, range, filters, t->page);
+        return;
     }
 
-    FILE *fp = fopen(output_file, "w");
-    if (!fp) { perror("fopen"); exit(1); }
+    int n = snprintf(url, size,
+                     "%s?"
+                     "url=%s&matchType=domain&fl=original,timestamp,statuscode,mimetype&"
+                     "collapse=urlkey%s%s%s&limit=%ld&showResumeKey=true",
+                     endpoint, job->full_domain, output, range, filters, opts->limit);
+    const char *resume_key = job->resume_keys[slice];
+    if (resume_key && n > 0 && (size_t)n < size) {
+        char *escaped = curl_easy_escape(t->curl, resume_key, 0);
+        if (!escaped) { fprintf(stderr, "curl_easy_escape() failed\n"); exit(1); }
+        snprintf(url + n, size - n, "&resumeKey=%s", escaped);
+        curl_free(escaped);
+    }
+}
 
-    fprintf(fp, "[\n");
-    for (int i = 0; i < endpoint_count; ++i) {
-        json_t *obj = json_object();
-        json_object_set_new(obj, "url", json_string(endpoints[i].url));
-        json_object_set_new(obj, "method", json_string(endpoints[i].method));
+// Reads the showNumPages reply, a bare page count. Returns -1 if it is not one.
+static long parse_num_pages(MemoryChunk *chunk) {
+    long pages = -1;
+    if (chunk->data) {
+        char *end = NULL;
+        errno = 0;
+        long v = strtol(chunk->data, &end, 10);
+        if (end != chunk->data && errno == 0 && v >= 0 && end[strspn(end, " \t\r\n")] == '\0') pages = v;
+    }
+    free(chunk->data); chunk->data = NULL; chunk->size = 0;
+    return pages;
+}
 
-        json_t *params_array = json_array();
-        for (int j = 0; j < endpoints[i].param_count; ++j) {
-            json_array_append_new(params_array, json_string(endpoints[i].params[j]));
-        }
-        json_object_set_new(obj, "parameters", params_array);
+static void pipeline_write(Pipeline *p, FILE *fp, char *buf, size_t len);
 
-        char *json_str = json_dumps(obj, JSON_INDENT(2) | JSON_ENSURE_ASCII);
-        if (json_str) {
-            if (i > 0) fprintf(fp, ",\n");
-            fprintf(fp, "%s", json_str);
-            free(json_str);
-        }
-        json_decref(obj);
+static void jw_flush(JsonWriter *w) {
+    if (w->pipe && w->len) {
+        pipeline_write(w->pipe, w->fp, w->buf, w->len);
+        w->buf = malloc(w->cap);
+        if (!w->buf) { perror("malloc"); exit(1); }
+    } else if (w->len && fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+        perror("fwrite");
+        exit(1);
     }
-    fprintf(fp, "\n]\n");
-    fclose(fp);
+    w->len = 0;
+}
 
-    for (int i = 0; i < endpoint_count; ++i) free_endpoint(&endpoints[i]);
-    free(endpoints);
+// Makes room for n more bytes; n must not exceed w->cap.
+static inline char *jw_reserve(JsonWriter *w, size_t n) {
+    if (w->cap - w->len < n) jw_flush(w);
+    return w->buf + w->len;
+}
 
-    if (!verbose) {
-        printf("\nRecon complete for %s. JSON output saved to %s\n", domain, output_file);
+static inline void jw_raw(JsonWriter *w, const char *s, size_t n) {
+    while (n > 0) {
+        const size_t chunk = n < w->cap ? n : w->cap;
+        memcpy(jw_reserve(w, chunk), s, chunk);
+        w->len += chunk;
+        s += chunk;
+        n -= chunk;
     }
-    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    const char *output_file = "endpoints.json";
-    long limit = 100000;
-    long timeout = 60;
-    int verbose = 0;
-    int sort_desc = 0;
-    const char *domain = NULL;
+#define jw_lit(w, s) jw_raw((w), (s), sizeof(s) - 1)
+
+// First byte in [s, end) that cannot be copied verbatim: '"', '\\', a control
+// character or any non-ASCII byte.
+static inline const char *scan_json_plain(const char *s, const char *end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        // Signed compare: bytes >= 0x80 are negative, so they count as < ' ' too.
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) return s + __builtin_ctz((unsigned)mask);
+        s += 16;
+    }
+#endif
+    while (s < end && (unsigned char)*s >= ' ' && (unsigned char)*s < 0x80 && *s != '"' && *s != '\\') ++s;
+    return s;
+}
 
-    int i = 1;
-    while (i < argc) {
-        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            print_help(argv[0]);
-            return 0;
-        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
-            if (++i >= argc) { fprintf(stderr, "Error: --output requires a filename\n"); return 1; }
-            output_file = argv[i];
-        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--limit") == 0) {
-            if (++i >= argc) { fprintf(stderr, "Error: --limit is required\n"); return 1; }
-            limit = atol(argv[i]);
-            if (limit <= 0 || limit > 150000) {
-                fprintf(stderr, "Error: limit must be 1150000\n"); return 1;
-            }
-        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timeout") == 0) {
-            if (++i >= argc) { fprintf(stderr, "Error: --timeout requires seconds\n"); return 1; }
-            timeout = atol(argv[i]);
-            if (timeout <= 0) { fprintf(stderr, "Error: timeout must be > 0\n"); return 1; }
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-            verbose = 1;
-        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--sort") == 0) {
-            if (++i >= argc) { fprintf(stderr, "Error: --sort requires asc/desc\n"); return 1; }
-            if (strcmp(argv[i], "desc") == 0) sort_desc = 1;
-            else if (strcmp(argv[i], "asc") == 0) sort_desc = 0;
-            else {
-                fprintf(stderr, "Error: --sort must be asc or desc\n"); return 1;
-            }
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "Unknown option: %s\n", argv[i]);
-            print_help(argv[0]);
-            return 1;
+// Decodes one UTF-8 sequence, returning its length, or 0 if it is invalid
+// (overlong, surrogate, out of range or truncated).
+static int decode_utf8(const unsigned char *s, const unsigned char *end, unsigned *cp) {
+    unsigned c = s[0];
+    int n;
+    unsigned min;
+    if (c >= 0xF0 && c <= 0xF4) { n = 4; c &= 0x07; min = 0x10000; }
+    else if (c >= 0xE0) { n = 3; c &= 0x0F; min = 0x800; }
+    else if (c >= 0xC2 && c < 0xE0) { n = 2; c &= 0x1F; min = 0x80; }
+    else return 0;
+    if (c >= 0xF5 || end - s < n) return 0;
+    for (int i = 1; i < n; ++i) {
+        if ((s[i] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0;
+    *cp = c;
+    return n;
+}
+
+static void jw_string(JsonWriter *w, const char *s, size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    const char *end = s + len;
+    jw_lit(w, "\"");
+    while (s < end) {
+        const char *plain = scan_json_plain(s, end);
+        jw_raw(w, s, (size_t)(plain - s));
+        s = plain;
+        if (s == end) break;
+
+        char *out = jw_reserve(w, 12);
+        const unsigned char c = (unsigned char)*s;
+        unsigned cp = c;
+        int used = 1;
+        char short_escape = 0;
+        switch (c) {
+            case '"': short_escape = '"'; break;
+            case '\\': short_escape = '\\'; break;
+            case '\b': short_escape = 'b'; break;
+            case '\f': short_escape = 'f'; break;
+            case '\n': short_escape = 'n'; break;
+            case '\r': short_escape = 'r'; break;
+            case '\t': short_escape = 't'; break;
+        }
+        if (short_escape) {
+            out[0] = '\\'; out[1] = short_escape; w->len += 2;
+            ++s;
+            continue;
+        }
+        if (c >= 0x80) {
+            used = decode_utf8((const unsigned char *)s, (const unsigned char *)end, &cp);
+            if (used == 0) { cp = 0xFFFD; used = 1; }  // invalid byte: replacement character
+        }
+        if (cp >= 0x10000) {
+            const unsigned v = cp - 0x10000;
+            const unsigned hi = 0xD800 | (v >> 10), lo = 0xDC00 | (v & 0x3FF);
+            memcpy(out, "\\u", 2);
+            for (int k = 0; k < 4; ++k) out[2 + k] = hex[(hi >> (12 - 4 * k)) & 0xF];
+            memcpy(out + 6, "\\u", 2);
+            for (int k = 0; k < 4; ++k) out[8 + k] = hex[(lo >> (12 - 4 * k)) & 0xF];
+            w->len += 12;
         } else {
-            if (domain != NULL) {
-                fprintf(stderr, "Error: Only one domain allowed\n");
-                return 1;
-            }
-            domain = argv[i];
+            memcpy(out, "\\u", 2);
+            for (int k = 0; k < 4; ++k) out[2 + k] = hex[(cp >> (12 - 4 * k)) & 0xF];
+            w->len += 6;
         }
-        ++i;
+        s += used;
     }
+    jw_lit(w, "\"");
+}
 
-    if (argc == 1 || (argc > 1 && strcmp(argv[1], "-") == 0)) {
-        char line[MAX_LINE_LEN];
-        while (fgets(line, sizeof(line), stdin)) {
-            size_t len = strcspn(line, "\r\n");
-            if (len == 0) continue;
-            char domain_buf[MAX_LINE_LEN];
-            safe_strncpy(domain_buf, line, len + 1);
-
-            if (strlen(domain_buf) == 0 || strlen(domain_buf) > MAX_DOMAIN_LEN) {
-                fprintf(stderr, "Invalid domain: empty or too long\n");
-                continue;
-            }
-
-            printf("\n=== Processing: %s ===\n", domain_buf);
-            if (process_domain(domain_buf, output_file, limit, timeout, verbose, sort_desc) != 0) {
-                fprintf(stderr, "Failed to process %s\n", domain_buf);
-            }
+// One endpoint object, laid out like json_dumps() with JSON_INDENT(2) or JSON_COMPACT.
+static void jw_endpoint(JsonWriter *w, const Endpoint *e, const InternTable *params) {
+    const char *method = method_names[e->method];
+    if (w->compact) {
+        jw_lit(w, "{\"url\":");
+        jw_string(w, e->url, strlen(e->url));
+        jw_lit(w, ",\"method\":");
+        jw_string(w, method, strlen(method));
+        jw_lit(w, ",\"parameters\":[");
+        for (int j = 0; j < e->param_count; ++j) {
+            if (j > 0) jw_lit(w, ",");
+            jw_string(w, params->strs[e->param_ids[j]], params->lens[e->param_ids[j]]);
         }
-        return 0;
+        jw_lit(w, "]}");
+        return;
     }
 
-    if (domain == NULL) {
-        fprintf(stderr, "Error: Domain is required (or use pipe input)\n");
-        print_help(argv[0]);
-        return 1;
+    jw_lit(w, "{\n  \"url\": ");
+    jw_string(w, e->url, strlen(e->url));
+    jw_lit(w, ",\n  \"method\": ");
+    jw_string(w, method, strlen(method));
+    jw_lit(w, ",\n  \"parameters\": [");
+    for (int j = 0; j < e->param_count; ++j) {
+        if (j > 0) jw_lit(w, ",");
+        jw_lit(w, "\n    ");
+        jw_string(w, params->strs[e->param_ids[j]], params->lens[e->param_ids[j]]);
     }
+    if (e->param_count > 0) jw_lit(w, "\n  ");
+    jw_lit(w, "]\n}");
+}
 
-    if (strlen(domain) == 0 || strlen(domain) > MAX_DOMAIN_LEN) {
-        fprintf(stderr, "Invalid domain: empty or too long\n");
-        return 1;
+// Opens path ("-" for stdout) for a JSON array or NDJSON lines, appending
+// instead of truncating if append is set. The writer does its own buffering,
+// so the stream is unbuffered and every jw_flush() reaches the file (or the
+// pipe behind stdout) at once.
+static void jw_open(JsonWriter *w, const char *path, const Options *opts, size_t cap) {
+    *w = (JsonWriter){ .fp = strcmp(path, "-") == 0 ? stdout : fopen(path, opts->append ? "a" : "w"),
+                       .buf = malloc(cap), .cap = cap, .format = opts->format,
+                       .compact = opts->compact || opts->format == FORMAT_NDJSON };
+    if (!w->fp) { perror(path); exit(1); }
+    if (!w->buf) { perror("malloc"); exit(1); }
+    setvbuf(w->fp, NULL, _IONBF, 0);
+    if (w->format == FORMAT_JSON) jw_lit(w, "[\n");
+}
+
+static inline void jw_item(JsonWriter *w, const Endpoint *e, const InternTable *params) {
+    if (w->format == FORMAT_NDJSON) {
+        jw_endpoint(w, e, params);
+        jw_lit(w, "\n");
+    } else {
+        if (w->count > 0) jw_lit(w, ",\n");
+        jw_endpoint(w, e, params);
     }
+    ++w->count;
+}
+
+static void jw_close(JsonWriter *w) {
+    if (w->format == FORMAT_JSON) jw_lit(w, "\n]\n");
+    jw_flush(w);
+    free(w->buf);
+    if (w->pipe) pipeline_write(w->pipe, w->fp, NULL, 0);  // the writer closes it after the data
+    else if (w->fp != stdout && fclose(w->fp) != 0) { perror("fclose"); exit(1); }
+    *w = (JsonWriter){0};
+}
+
+// --trace: spans recorded into a buffer owned by the recording thread, so
+// recording takes no lock. A full buffer is formatted and written by its
+// owner in one fwrite() of whole events; trace_close() writes the rest once
+// every other thread is done. Requests and domains overlap on one thread, so
+// they become async b/e pairs; parse, sort and write spans are plain X events.
+typedef struct {
+    const char *name;  // static string
+    long long start_ns;
+    long long end_ns;
+    long arg;          // page or time slice, -1 for none
+    int async;
+    char domain[TRACE_DOMAIN_LEN];
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;  // every thread's buffer, for trace_close()
+    const char *thread_name;
+    int tid;
+    int count;
+    JsonWriter out;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+static int tracing;  // the one branch every trace point takes when --trace is off
+static FILE *trace_fp;
+static long long trace_epoch_ns;
+static _Atomic(TraceBuffer *) trace_buffers;
+static atomic_int trace_next_tid;
+static atomic_long trace_next_id;
+static _Thread_local TraceBuffer *trace_buffer;
+
+static void trace_open(const char *path) {
+    trace_fp = fopen(path, "w");
+    if (!trace_fp) { perror(path); exit(1); }
+    setvbuf(trace_fp, NULL, _IONBF, 0);
+    if (fputs("{\"traceEvents\":[\n", trace_fp) == EOF) { perror("fputs"); exit(1); }
+    trace_epoch_ns = monotonic_ns();
+    tracing = 1;
+}
+
+static TraceBuffer *trace_thread_buffer(void) {
+    if (trace_buffer) return trace_buffer;
+    TraceBuffer *b = calloc(1, sizeof *b);
+    if (!b) { perror("calloc"); exit(1); }
+    b->tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+    b->out = (JsonWriter){ .fp = trace_fp, .buf = malloc(DOMAIN_WRITER_BUFFER), .cap = DOMAIN_WRITER_BUFFER,
+                           .compact = 1, .format = FORMAT_NDJSON };
+    if (!b->out.buf) { perror("malloc"); exit(1); }
+    b->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &b->next, b)) {}
+    return trace_buffer = b;
+}
+
+static void trace_thread_name(const char *name) {
+    trace_thread_buffer()->thread_name = name;
+}
+
+// Timestamps are microseconds since trace_open(), as the format expects.
+static void trace_event_head(JsonWriter *w, const TraceEvent *e, const char *ph, long id, int tid, long long ns) {
+    jw_lit(w, "{\"name\":");
+    jw_string(w, e->name, strlen(e->name));
+    char *out = jw_reserve(w, 128);
+    w->len += (size_t)snprintf(out, 128, ",\"ph\":\"%s\",\"pid\":%ld,\"tid\":%d,\"ts\":%.3f",
+                               ph, (long)getpid(), tid, (double)(ns - trace_epoch_ns) / 1000.0);
+    if (id >= 0) {
+        out = jw_reserve(w, 64);
+        w->len += (size_t)snprintf(out, 64, ",\"cat\":\"%s\",\"id\":%ld", e->name, id);
+    }
+}
+
+static void trace_event_args(JsonWriter *w, const TraceEvent *e) {
+    jw_lit(w, ",\"args\":{\"domain\":");
+    jw_string(w, e->domain, strlen(e->domain));
+    if (e->arg >= 0) {
+        char *out = jw_reserve(w, 32);
+        w->len += (size_t)snprintf(out, 32, ",\"page\":%ld", e->arg);
+    }
+    jw_lit(w, "}},\n");
+}
+
+static void trace_flush(TraceBuffer *b) {
+    JsonWriter *w = &b->out;
+    for (int i = 0; i < b->count; ++i) {
+        const TraceEvent *e = &b->events[i];
+        // Flushing only between events keeps other threads' writes from splitting one.
+        if (w->cap - w->len < TRACE_EVENT_MAX) jw_flush(w);
+        if (e->async) {
+            const long id = atomic_fetch_add(&trace_next_id, 1);
+            trace_event_head(w, e, "b", id, b->tid, e->start_ns);
+            trace_event_args(w, e);
+            trace_event_head(w, e, "e", id, b->tid, e->end_ns);
+            jw_lit(w, "},\n");
+        } else {
+            trace_event_head(w, e, "X", -1, b->tid, e->start_ns);
+            char *out = jw_reserve(w, 64);
+            w->len += (size_t)snprintf(out, 64, ",\"dur\":%.3f", (double)(e->end_ns - e->start_ns) / 1000.0);
+            trace_event_args(w, e);
+        }
+    }
+    jw_flush(w);
+    b->count = 0;
+}
+
+static void trace_span(const char *name, const char *domain, long arg, long long start_ns, long long end_ns, int async) {
+    TraceBuffer *b = trace_thread_buffer();
+    if (b->count == TRACE_BUFFER_EVENTS) trace_flush(b);
+    TraceEvent *e = &b->events[b->count++];
+    e->name = name;
+    e->start_ns = start_ns;
+    e->end_ns = end_ns;
+    e->arg = arg;
+    e->async = async;
+    safe_strcpy(e->domain, domain, sizeof(e->domain));
+}
+
+// Call with every recording thread finished.
+static void trace_close(void) {
+    if (!tracing) return;
+    tracing = 0;
+    TraceBuffer *b = atomic_exchange(&trace_buffers, NULL);
+    while (b) {
+        TraceBuffer *next = b->next;
+        trace_flush(b);
+        if (b->thread_name) {
+            fprintf(trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%d,"
+                              "\"args\":{\"name\":\"%s\"}},\n", (long)getpid(), b->tid, b->thread_name);
+        }
+        free(b->out.buf);
+        free(b);
+        b = next;
+    }
+    trace_buffer = NULL;
+    if (fprintf(trace_fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":\"wayback_recon\"}}\n"
+                          "],\"displayTimeUnit\":\"ms\"}\n", (long)getpid()) < 0 || fclose(trace_fp) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+    trace_fp = NULL;
+}
+
+// Creates the missing directories leading up to the file at path.
+static void make_parent_dirs(const char *path) {
+    char dir[MAX_LINE_LEN];
+    safe_strcpy(dir, path, sizeof(dir));
+    for (char *p = dir + 1; *p; ++p) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) { perror(dir); exit(1); }
+        *p = '/';
+    }
+}
+
+// Expands every {domain} in tpl, with bytes that are unsafe in a file name
+// (a "://" scheme, '/', wildcards) replaced by '_'.
+static void expand_output_template(const char *tpl, const char *domain, char *out, size_t size) {
+    const char *scheme = strstr(domain, "://");
+    if (scheme) domain = scheme + 3;
+
+    size_t n = 0;
+    while (*tpl && n + 1 < size) {
+        if (strncmp(tpl, "{domain}", 8) == 0) {
+            for (const char *d = domain; *d && n + 1 < size; ++d) {
+                out[n++] = isalnum((unsigned char)*d) || *d == '.' || *d == '-' ? *d : '_';
+            }
+            tpl += 8;
+        } else {
+            out[n++] = *tpl++;
+        }
+    }
+    out[n] = '\0';
+}
+
+// Requests one domain can have in flight: its pages or its time slices, each
+// with its prefetched next page under --threads.
+static inline int requests_per_domain(const Options *opts) {
+    const int n = max(max(opts->page_concurrency, opts->slice_concurrency), 1);
+    return opts->threads > 0 && opts->page_concurrency == 0 ? 2 * n : n;
+}
+
+static inline int output_is_stdout(const Options *opts) {
+    return !opts->output_template && strcmp(opts->output_file, "-") == 0;
+}
+
+// Progress messages move to stderr when stdout carries the output.
+static inline FILE *info_stream(const Options *opts) {
+    return output_is_stdout(opts) ? stderr : stdout;
+}
+
+// Interns the names of the query parameters of url (the part of each
+// '&'-separated token before '='), looking at most MAX_PARAM_LEN - 1 bytes in.
+static int split_params(InternTable *params, const char *url, uint32_t *ids) {
+    const char *qmark = strchr(url, '?');
+    if (!qmark) return 0;
+
+    const char *q = qmark + 1;
+    const char *end = q + strnlen(q, MAX_PARAM_LEN - 1);
+    int n = 0;
+    while (q < end) {
+        const char *amp = memchr(q, '&', (size_t)(end - q));
+        if (!amp) amp = end;
+        const char *eq = memchr(q, '=', (size_t)(amp - q));
+        const char *name_end = eq ? eq : amp;
+        if (name_end > q) ids[n++] = (uint32_t)intern(params, q, (size_t)(name_end - q), NULL);
+        q = amp + 1;
+    }
+    return n;
+}
+
+// url is already interned in job->seen.
+static void add_endpoint(DomainJob *job, const char *url, size_t url_len, Method method) {
+    uint32_t ids[MAX_PARAM_LEN / 2];
+    const int param_count = split_params(&job->params, url, ids);
+
+    if (!job->quiet && job->progress) {
+        JsonWriter *w = job->progress;
+        jw_raw(w, url, url_len);
+        jw_lit(w, " | ");
+        jw_raw(w, method_names[method], strlen(method_names[method]));
+        jw_lit(w, " | ");
+        if (param_count == 0) jw_lit(w, "none");
+        for (int j = 0; j < param_count; ++j) {
+            if (j > 0) jw_lit(w, ", ");
+            jw_raw(w, job->params.strs[ids[j]], job->params.lens[ids[j]]);
+        }
+        jw_lit(w, "\n");
+    } else if (!job->quiet) {
+        printf("%s | %s | ", url, method_names[method]);
+        if (param_count == 0) printf("none\n");
+        else {
+            for (int j = 0; j < param_count; ++j) {
+                printf("%s%s", job->params.strs[ids[j]], j < param_count - 1 ? ", " : "\n");
+            }
+        }
+        fflush(stdout);
+    }
+
+    if (job->stream) {
+        const Endpoint e = { .url = url, .param_ids = ids, .param_count = param_count, .method = method };
+        const long long t0 = job->timed ? monotonic_ns() : 0;
+        jw_item(job->stream, &e, &job->params);
+        if (job->timed) job->stats.serialize_ns += monotonic_ns() - t0;
+        ++job->endpoint_count;
+        return;
+    }
+
+    if (job->endpoint_count == job->endpoint_capacity) {
+        job->endpoint_capacity = max(job->endpoint_capacity * 2, INITIAL_CAPACITY);
+        job->endpoints = realloc(job->endpoints, job->endpoint_capacity * sizeof *job->endpoints);
+        if (!job->endpoints) { perror("realloc"); exit(1); }
+    }
+
+    Endpoint *e = &job->endpoints[job->endpoint_count++];
+    e->url = url;
+    e->method = method;
+    e->param_count = param_count;
+    e->param_ids = NULL;
+    if (param_count > 0) {
+        uint32_t *stored = arena_alloc(&job->arena, param_count * sizeof *stored, alignof(uint32_t));
+        memcpy(stored, ids, param_count * sizeof *stored);
+        e->param_ids = stored;
+    }
+}
+
+// Row handler for CDX pages: row 0 is the field header, then data rows, then
+// (with showResumeKey) an empty row followed by a one-element ["<key>"] row.
+// Checkpoint journal, one per domain under --checkpoint DIR, NDJSON:
+//   {"url":"...","mimetype":"..."}  a new endpoint (the CDX fields it came from)
+//   {"resumeKey":"..."}             chain mode: every row up to this key is in
+//   {"slice":N,"resumeKey":"..."}   the same for one slice under --shard
+//   {"slice":N}                     --shard: the slice is finished
+//   {"pages":N} / {"page":N}        paged mode: page count, one finished page
+//   {"done":true}                   the domain finished and its output was written
+// Records are buffered in memory and appended at page boundaries, so a killed
+// run loses at most the pages that were in flight.
+static void journal_open(DomainJob *job) {
+    job->journal = (JsonWriter){ .fp = open_memstream(&job->journal_buf, &job->journal_size),
+                                 .buf = malloc(DOMAIN_WRITER_BUFFER), .cap = DOMAIN_WRITER_BUFFER,
+                                 .compact = 1, .format = FORMAT_NDJSON };
+    if (!job->journal.fp || !job->journal.buf) { perror("open_memstream"); exit(1); }
+}
+
+static void journal_commit(DomainJob *job) {
+    jw_flush(&job->journal);
+    if (fclose(job->journal.fp) != 0) { perror("fclose"); exit(1); }
+    if (job->journal_size > 0) {
+        FILE *fp = fopen(job->journal_path, "a");
+        if (!fp || fwrite(job->journal_buf, 1, job->journal_size, fp) != job->journal_size || fclose(fp) != 0) {
+            perror(job->journal_path);
+            exit(1);
+        }
+    }
+    free(job->journal_buf);
+    job->journal_buf = NULL;
+    job->journal_size = 0;
+    job->journal.fp = open_memstream(&job->journal_buf, &job->journal_size);
+    if (!job->journal.fp) { perror("open_memstream"); exit(1); }
+}
+
+static void journal_close(DomainJob *job) {
+    journal_commit(job);
+    fclose(job->journal.fp);
+    free(job->journal_buf);
+    free(job->journal.buf);
+    job->journal = (JsonWriter){0};
+}
+
+// The url record, shared by the checkpoint journal and the --state-dir file.
+static void journal_row(JsonWriter *w, const char *url, size_t url_len, const CdxField *mimetype) {
+    jw_lit(w, "{\"url\":");
+    jw_string(w, url, url_len);
+    jw_lit(w, ",\"mimetype\":");
+    if (mimetype->ptr) jw_string(w, mimetype->ptr, mimetype->len);
+    else jw_lit(w, "null");
+    jw_lit(w, "}\n");
+}
+
+static void journal_resume_key(DomainJob *job, long slice, const char *key, int sharded) {
+    char prefix[64];
+    const int len = sharded ? snprintf(prefix, sizeof(prefix), "{\"slice\":%ld,\"resumeKey\":", slice)
+                            : snprintf(prefix, sizeof(prefix), "{\"resumeKey\":");
+    jw_raw(&job->journal, prefix, (size_t)len);
+    jw_string(&job->journal, key, strlen(key));
+    jw_lit(&job->journal, "}\n");
+    journal_commit(job);
+}
+
+static void journal_number(DomainJob *job, const char *key, long n) {
+    char line[64];
+    const int len = snprintf(line, sizeof(line), "{\"%s\":%ld}\n", key, n);
+    jw_raw(&job->journal, line, (size_t)len);
+    journal_commit(job);
+}
+
+static void journal_num_pages(DomainJob *job) { journal_number(job, "pages", job->num_pages); }
+static void journal_page(DomainJob *job, long page) { journal_number(job, "page", page); }
+static void journal_slice(DomainJob *job, long slice) { journal_number(job, "slice", slice); }
+
+// Replays a checkpoint journal or --state-dir file of a previous run into a
+// fresh job: endpoints, the last resumeKey of every slice, the finished pages
+// and slices, and the newest capture. Endpoints new to the job are also
+// written to copy, if set. A torn last line (the run was killed mid-append) is
+// cut off so new records start on a clean line. A checkpoint must be resumed
+// with the same --shard and time range as before. The newest capture is only
+// taken from runs with the same scope (see Options.query_scope); a narrower
+// run never fetched what lies outside it. Returns the endpoints added, or -1
+// if path does not exist.
+static long journal_replay(DomainJob *job, const char *path, JsonWriter *copy, int paged, long slice_count,
+                           const char *scope) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno != ENOENT) { perror(path); exit(1); }
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    off_t good = 0;
+    long rows = 0;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        json_error_t err;
+        json_t *rec = line[len - 1] == '\n' ? json_loads(line, 0, &err) : NULL;
+        if (!json_is_object(rec)) { json_decref(rec); break; }
+        good += len;
+
+        json_t *v;
+        if ((v = json_object_get(rec, "url")) && json_is_string(v)) {
+            json_t *m = json_object_get(rec, "mimetype");
+            const CdxField mimetype = { json_is_string(m) ? json_string_value(m) : NULL,
+                                        json_is_string(m) ? json_string_length(m) : 0 };
+            const char *url;
+            if (add_url(&job->seen, json_string_value(v), json_string_length(v), &url)) {
+                add_endpoint(job, url, json_string_length(v),
+                             infer_method(url, json_string_length(v), mimetype.ptr, mimetype.len));
+                if (copy) journal_row(copy, url, json_string_length(v), &mimetype);
+                ++rows;
+            }
+        } else if ((v = json_object_get(rec, "resumeKey")) && json_is_string(v) && !paged) {
+            json_t *s = json_object_get(rec, "slice");
+            const long slice = json_is_integer(s) ? (long)json_integer_value(s) : 0;
+            if (slice >= 0 && slice < slice_count) {
+                free(job->resume_keys[slice]);
+                job->resume_keys[slice] = strdup(json_string_value(v));
+                if (!job->resume_keys[slice]) { perror("strdup"); exit(1); }
+            }
+        } else if ((v = json_object_get(rec, "slice")) && json_is_integer(v) && !paged) {
+            const long slice = (long)json_integer_value(v);
+            if (slice >= 0 && slice < slice_count) job->slice_done[slice] = 1;
+        } else if ((v = json_object_get(rec, "pages")) && json_is_integer(v) && paged) {
+            job->num_pages = (long)json_integer_value(v);
+            free(job->page_done);
+            job->page_done = calloc((size_t)job->num_pages + 1, 1);
+            if (!job->page_done) { perror("calloc"); exit(1); }
+        } else if ((v = json_object_get(rec, "page")) && json_is_integer(v) && job->page_done) {
+            const long page = (long)json_integer_value(v);
+            if (page >= 0 && page < job->num_pages) job->page_done[page] = 1;
+        } else if ((v = json_object_get(rec, "newest")) && json_is_string(v) && json_string_length(v) < sizeof(job->since)) {
+            // Records written before scopes were kept are from unbounded runs.
+            json_t *s = json_object_get(rec, "scope");
+            if (scope && strcmp(json_is_string(s) ? json_string_value(s) : "", scope) == 0) {
+                safe_strcpy(job->since, json_string_value(v), sizeof(job->since));
+            }
+        } else if (json_is_true(json_object_get(rec, "done"))) {
+            job->resumed_done = 1;
+        }
+        json_decref(rec);
+    }
+    const int torn = len > 0 || !feof(fp);
+    free(line);
+    fclose(fp);
+    if (torn && truncate(path, good) != 0) { perror(path); exit(1); }
+    return rows;
+}
+
+// The --state-dir file is only ever appended to: url records as endpoints are
+// found, {"newest":"<timestamp>","scope":"<range and filters>"} once a run
+// has fetched everything in its scope up to that capture.
+static void state_open(DomainJob *job) {
+    job->state = (JsonWriter){ .fp = fopen(job->state_path, "a"), .buf = malloc(DOMAIN_WRITER_BUFFER),
+                               .cap = DOMAIN_WRITER_BUFFER, .compact = 1, .format = FORMAT_NDJSON };
+    if (!job->state.fp) { perror(job->state_path); exit(1); }
+    if (!job->state.buf) { perror("malloc"); exit(1); }
+}
+
+// A failed run keeps its endpoints but not its newest capture, so the next run
+// asks for the same range again.
+static void state_close(DomainJob *job, const char *scope) {
+    if (!job->failed && strcmp(job->newest, job->since) != 0) {
+        jw_lit(&job->state, "{\"newest\":");
+        jw_string(&job->state, job->newest, strlen(job->newest));
+        jw_lit(&job->state, ",\"scope\":");
+        jw_string(&job->state, scope, strlen(scope));
+        jw_lit(&job->state, "}\n");
+    }
+    jw_flush(&job->state);
+    free(job->state.buf);
+    if (fclose(job->state.fp) != 0) { perror(job->state_path); exit(1); }
+    job->state = (JsonWriter){0};
+}
+
+static void set_resume_key(DomainJob *job, long slice, const CdxField *key) {
+    free(job->resume_keys[slice]);
+    job->resume_keys[slice] = strndup(key->ptr, key->len);
+    if (!job->resume_keys[slice]) { perror("strndup"); exit(1); }
+}
+
+// One capture row: deduplicated, then classified and recorded if its URL is
+// new. method < 0 infers it here, after the dedup; the parser threads infer
+// it before.
+static void take_capture(DomainJob *job, const CdxField *url_field, const CdxField *timestamp,
+                         const CdxField *mimetype, int method) {
+    // CDX timestamps are all 14 digits, so a byte compare orders them.
+    if (timestamp->len == 14 && memcmp(timestamp->ptr, job->newest, 14) > 0) {
+        memcpy(job->newest, timestamp->ptr, 14);
+        job->newest[14] = '\0';
+    }
+    ++job->stats.rows;
+    const long long t0 = job->timed ? monotonic_ns() : 0;
+    const char *url;
+    const int added = add_url(&job->seen, url_field->ptr, url_field->len, &url);
+    const long long t1 = job->timed ? monotonic_ns() : 0;
+    if (job->timed) job->stats.dedup_ns += t1 - t0;
+    if (added) {
+        const long long serialized = job->stats.serialize_ns;
+        if (method < 0) method = infer_method(url, url_field->len, mimetype->ptr, mimetype->len);
+        add_endpoint(job, url, url_field->len, (Method)method);
+        if (job->timed) job->stats.classify_ns += monotonic_ns() - t1 - (job->stats.serialize_ns - serialized);
+        if (job->journal.fp) journal_row(&job->journal, url, url_field->len, mimetype);
+        if (job->state.fp) journal_row(&job->state, url, url_field->len, mimetype);
+    } else {
+        ++job->stats.duplicates;
+    }
+}
+
+static void handle_row(void *userp, long row, const CdxField *fields, int nfields) {
+    Transfer *t = userp;
+    DomainJob *job = t->job;
+    if (row == 0) return;
+
+    if (nfields == 0) {
+        t->saw_blank_row = 1;
+    } else if (t->saw_blank_row && nfields == 1) {
+        if (t->kind == REQ_CHAIN && fields[0].ptr && fields[0].len > 0) set_resume_key(job, t->page, &fields[0]);
+    } else if (nfields >= 4 && fields[0].ptr) {
+        take_capture(job, &fields[0], &fields[1], &fields[3], -1);
+    }
+}
+
+static size_t pipeline_feed(Pipeline *p, Transfer *t, const char *data, size_t len);
+
+static size_t TransferWriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    Transfer *t = userp;
+    const size_t realsize = size * nmemb;
+    // Error pages (429/503 bodies and the like) are neither rows nor a page count.
+    if (t->status == 0) curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &t->status);
+    if (t->status < 200 || t->status >= 300) return realsize;
+    if (t->kind == REQ_NUM_PAGES) return WriteMemoryCallback(contents, size, nmemb, &t->chunk);
+
+    DomainJob *job = t->job;
+    if (job->pipe) return pipeline_feed(job->pipe, t, contents, realsize);
+    job->stats.body_bytes += (long long)realsize;
+    if (job->timed) {
+        // Parse time is what the row handler's stages leave of the feed.
+        const Stats before = job->stats;
+        const long long t0 = monotonic_ns();
+        const int rc = cdx_parser_feed(&t->parser, contents, realsize);
+        const long long t1 = monotonic_ns();
+        job->stats.parse_ns += t1 - t0 - (job->stats.dedup_ns - before.dedup_ns) -
+                               (job->stats.classify_ns - before.classify_ns) -
+                               (job->stats.serialize_ns - before.serialize_ns);
+        if (rc != 0) return 0;
+        if (job->stream && job->stream->len) jw_flush(job->stream);
+        const long long t2 = monotonic_ns();
+        job->stats.serialize_ns += t2 - t1;
+        if (tracing) {
+            trace_span("parse", job->domain, t->page, t0, t1, 0);
+            if (job->stream) trace_span("write", job->domain, t->page, t1, t2, 0);
+        }
+        return realsize;
+    }
+
+    // Returning short aborts the transfer: the rest of a non-CDX body is useless.
+    if (cdx_parser_feed(&t->parser, contents, realsize) != 0) return 0;
+    // Hand the endpoints of this delivery downstream now, not when the domain ends.
+    if (job->stream && job->stream->len) jw_flush(job->stream);
+    return realsize;
+}
+
+// Checks how the streamed page ended. Returns 0 if it was a complete CDX
+// array, 1 for an empty body (no captures) and -1 for a broken one.
+static int finish_page(Transfer *t) {
+    CdxParser *p = &t->parser;
+    cdx_parser_finish(p);
+    if (p->state == CDX_DONE) return 0;
+    if (p->state == CDX_START && p->total == 0) return 1;
+    fprintf(stderr, "%s parse error for %s: %s\n", p->text ? "CDX text" : "JSON", t->job->domain,
+            p->state == CDX_ERROR ? p->error : "truncated response");
+    return -1;
+}
+
+// Unsorted NDJSON went out while the pages streamed in; everything else is
+// sorted and written now, into the job's own file under --output-template or
+// into the run's shared output.
+static void write_output(EventLoop *loop, DomainJob *job) {
+    const Options *opts = loop->opts;
+    if (job->stream) {
+        if (job->stream == &job->out) jw_close(&job->out);
+        else if (!loop->pipe) jw_flush(job->stream);  // the event loop flushes the shared stream
+        return;
+    }
+    const long long t0 = job->timed ? monotonic_ns() : 0;
+    if (job->endpoint_count > 0 && opts->sort != SORT_NONE) {
+        qsort(job->endpoints, job->endpoint_count, sizeof *job->endpoints,
+              opts->sort == SORT_DESC ? compare_endpoints_desc : compare_endpoints_asc);
+    }
+    const long long t1 = job->timed ? monotonic_ns() : 0;
+    if (job->timed) {
+        job->stats.sort_ns += t1 - t0;
+        if (tracing) trace_span("sort", job->domain, -1, t0, t1, 0);
+    }
+
+    JsonWriter *w = &loop->out;
+    if (opts->output_template) {
+        make_parent_dirs(job->output_path);
+        jw_open(&job->out, job->output_path, opts, DOMAIN_WRITER_BUFFER);
+        w = &job->out;
+    }
+    for (int i = 0; i < job->endpoint_count; ++i) jw_item(w, &job->endpoints[i], &job->params);
+    if (w == &job->out) jw_close(w);
+    else jw_flush(w);
+    if (job->timed) {
+        const long long t2 = monotonic_ns();
+        job->stats.serialize_ns += t2 - t1;
+        if (tracing) trace_span("write", job->domain, -1, t1, t2, 0);
+    }
+}
+
+static void push_ready(EventLoop *loop, Transfer *t) {
+    t->next_ready = NULL;
+    if (loop->ready_tail) loop->ready_tail->next_ready = t;
+    else loop->ready_head = t;
+    loop->ready_tail = t;
+}
+
+static void pipe_row(void *userp, long row, const CdxField *fields, int nfields);
+
+static void reset_transfer(Transfer *t) {
+    t->status = 0;
+    t->saw_blank_row = 0;
+    free(t->chunk.data); t->chunk.data = NULL; t->chunk.size = 0;
+    cdx_parser_reset(&t->parser, t->job->pipe ? pipe_row : handle_row, t);
+    t->fed = 0;
+    atomic_store(&t->parse_failed, 0);
+    t->parse_ns = t->classify_ns = 0;
+    t->busy = 1;
+    ++t->attempt;
+    ++t->job->inflight;
+}
+
+static void enqueue_transfer(EventLoop *loop, Transfer *t) {
+    reset_transfer(t);
+    push_ready(loop, t);
+}
+
+// Sends the same URL again after an exponential backoff with equal jitter, so
+// pages that failed together do not all come back at once. Rows the failed
+// attempt already delivered are deduplicated when they arrive again.
+static void retry_transfer(EventLoop *loop, Transfer *t) {
+    ++t->retries;
+    long long base = (long long)RETRY_BACKOFF_MS << (t->retries - 1);
+    if (base > MAX_BACKOFF_MS) base = MAX_BACKOFF_MS;
+    loop->rng ^= loop->rng << 13; loop->rng ^= loop->rng >> 7; loop->rng ^= loop->rng << 17;
+    const long long delay = base / 2 + (long long)(loop->rng % (uint64_t)(base / 2 + 1));
+
+    if (loop->opts->verbose) {
+        fprintf(stderr, "Retrying %s in %lld ms (%d/%d)\n", t->job->domain, delay, t->retries, loop->opts->retries);
+    }
+    reset_transfer(t);
+    t->retry_at = monotonic_ms() + delay;
+    t->next_ready = loop->delayed;
+    loop->delayed = t;
+}
+
+// Moves retries whose backoff is over to the ready queue. Returns the earliest
+// backoff still running, or -1.
+static long long promote_retries(EventLoop *loop, long long now) {
+    long long next = -1;
+    Transfer **link = &loop->delayed;
+    while (*link) {
+        Transfer *t = *link;
+        if (t->retry_at <= now) {
+            *link = t->next_ready;
+            push_ready(loop, t);
+        } else {
+            if (next < 0 || t->retry_at < next) next = t->retry_at;
+            link = &t->next_ready;
+        }
+    }
+    return next;
+}
+
+// Prepares the request and queues it; dispatch() sends it when the rate
+// limits allow.
+static void start_transfer(EventLoop *loop, Transfer *t, RequestKind kind, long page) {
+    DomainJob *job = t->job;
+    t->kind = kind;
+    t->page = page;
+    t->attempts = 0;
+    t->retries = 0;
+    build_query_url(t, loop->opts, t->url, sizeof(t->url));
+    if (kind == REQ_CHAIN) {
+        free(job->resume_keys[page]);
+        job->resume_keys[page] = NULL;
+    }
+    enqueue_transfer(loop, t);
+}
+
+static void refill_buckets(EventLoop *loop, long long now) {
+    const Options *opts = loop->opts;
+    const double elapsed = (double)(now - loop->refill_ms) / 1000.0;
+    loop->refill_ms = now;
+    // Bursts are capped at one second's worth.
+    if (opts->rate > 0) {
+        loop->tokens += elapsed * opts->rate;
+        if (loop->tokens > (opts->rate > 1 ? opts->rate : 1)) loop->tokens = opts->rate > 1 ? opts->rate : 1;
+    }
+    if (opts->byte_rate > 0) {
+        loop->byte_tokens += elapsed * (double)opts->byte_rate;
+        if (loop->byte_tokens > (double)opts->byte_rate) loop->byte_tokens = (double)opts->byte_rate;
+    }
+}
+
+static inline long long earliest(long long a, long long b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+// Hands queued requests to curl while the window and buckets allow. Returns
+// when (CLOCK_MONOTONIC ms) a blocked queue or a pending retry can move, or -1.
+static long long dispatch(EventLoop *loop) {
+    const Options *opts = loop->opts;
+    const long long next_retry = loop->delayed ? promote_retries(loop, monotonic_ms()) : -1;
+    while (loop->ready_head && loop->running < (int)loop->window) {
+        const long long now = monotonic_ms();
+        if (now < loop->paused_until) return earliest(next_retry, loop->paused_until);
+        refill_buckets(loop, now);
+        if (opts->rate > 0 && loop->tokens < 1.0) {
+            return earliest(next_retry, now + (long long)((1.0 - loop->tokens) * 1000.0 / opts->rate) + 1);
+        }
+        if (opts->byte_rate > 0 && loop->byte_tokens < 0) {
+            return earliest(next_retry, now + (long long)(-loop->byte_tokens * 1000.0 / (double)opts->byte_rate) + 1);
+        }
+
+        Transfer *t = loop->ready_head;
+        loop->ready_head = t->next_ready;
+        if (!loop->ready_head) loop->ready_tail = NULL;
+        if (opts->rate > 0) loop->tokens -= 1.0;
+
+        if (opts->verbose) {
+            fprintf(info_stream(opts), "Querying: %s\n", t->url);
+            fflush(info_stream(opts));
+        }
+        curl_easy_setopt(t->curl, CURLOPT_URL, t->url);
+        if (tracing) t->sent_ns = monotonic_ns();
+        CURLMcode mc = curl_multi_add_handle(loop->multi, t->curl);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi_add_handle() failed: %s\n", curl_multi_strerror(mc));
+            exit(1);
+        }
+        ++loop->running;
+    }
+    return next_retry;
+}
+
+// 429/503: halve the window (at most once a second, since every request in
+// flight reports the same overload) and pause the queue for Retry-After or,
+// without one, an exponential backoff.
+static void throttle(EventLoop *loop, const Transfer *t, long long retry_after_s) {
+    const long long now = monotonic_ms();
+    if (now - loop->last_decrease >= 1000) {
+        loop->window = loop->window / 2 > 1 ? loop->window / 2 : 1;
+        loop->last_decrease = now;
+    }
+    long long delay = retry_after_s > 0 ? retry_after_s * 1000 : (long long)THROTTLE_BACKOFF_MS << (t->attempts - 1);
+    if (delay > MAX_BACKOFF_MS) delay = MAX_BACKOFF_MS;
+    if (now + delay > loop->paused_until) loop->paused_until = now + delay;
+    if (loop->opts->verbose) {
+        fprintf(stderr, "HTTP %ld for %s, pausing %lld ms, window %d\n", t->status, t->job->domain, delay,
+                (int)loop->window);
+    }
+}
+
+// Additive increase: one more request in flight per window of good replies.
+static void speed_up(EventLoop *loop) {
+    loop->window += 1.0 / loop->window;
+    if (loop->window > loop->max_window) loop->window = loop->max_window;
+}
+
+// Hands the idle transfer the next unfetched page. Returns 0 when none are left.
+static int start_next_page(EventLoop *loop, Transfer *t) {
+    DomainJob *job = t->job;
+    while (job->page_done && job->next_page < job->num_pages && job->page_done[job->next_page]) ++job->next_page;
+    if (job->next_page >= job->num_pages) return 0;
+    start_transfer(loop, t, REQ_PAGE, job->next_page++);
+    return 1;
+}
+
+// Hands the idle transfer the next unfinished time slice, from its saved
+// resumeKey if a checkpoint has one. Returns 0 when none are left.
+static int start_next_slice(EventLoop *loop, Transfer *t) {
+    DomainJob *job = t->job;
+    const long count = max(loop->opts->slice_count, 1);
+    // Slices that end before the last run's newest capture have nothing new.
+    while (job->next_slice < count &&
+           (job->slice_done[job->next_slice] ||
+            (job->since[0] && loop->opts->slice_count > 0 && loop->opts->slices[job->next_slice].to[0] &&
+             timestamp_cmp(loop->opts->slices[job->next_slice].to, job->since) < 0))) {
+        ++job->next_slice;
+    }
+    if (job->next_slice >= count) return 0;
+    start_transfer(loop, t, REQ_CHAIN, job->next_slice++);
+    return 1;
+}
+
+// Takes an easy handle from the pool, configured with everything that is the
+// same for every request. Returns NULL if a new handle cannot be created.
+static CURL *acquire_handle(EventLoop *loop) {
+    if (loop->idle_count > 0) return loop->idle_handles[--loop->idle_count];
+
+    CURL *curl = curl_easy_init();
+    if (!curl) return NULL;
+    curl_easy_setopt(curl, CURLOPT_SHARE, loop->share);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, TransferWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "WaybackRecon/1.9.12");
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, loop->opts->timeout);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    // "" offers every encoding this libcurl can decode (gzip, deflate, br, zstd);
+    // the write callback still receives the decoded stream.
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    // The scheduler spaces requests out; this keeps one big reply under the cap too.
+    if (loop->opts->byte_rate > 0) curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)loop->opts->byte_rate);
+    return curl;
+}
+
+static void release_handle(EventLoop *loop, CURL *curl) {
+    if (loop->idle_count == loop->idle_capacity) {
+        loop->idle_capacity = max(loop->idle_capacity * 2, 16);
+        CURL **grown = realloc(loop->idle_handles, loop->idle_capacity * sizeof *grown);
+        if (!grown) { perror("realloc"); exit(1); }
+        loop->idle_handles = grown;
+    }
+    loop->idle_handles[loop->idle_count++] = curl;
+}
+
+static void stats_add(Stats *sum, const Stats *s) {
+    sum->requests += s->requests;
+    sum->pages += s->pages;
+    sum->bytes += s->bytes;
+    sum->body_bytes += s->body_bytes;
+    sum->rows += s->rows;
+    sum->duplicates += s->duplicates;
+    sum->endpoints += s->endpoints;
+    sum->request_ns += s->request_ns;
+    sum->parse_ns += s->parse_ns;
+    sum->dedup_ns += s->dedup_ns;
+    sum->classify_ns += s->classify_ns;
+    sum->sort_ns += s->sort_ns;
+    sum->serialize_ns += s->serialize_ns;
+}
+
+static void print_stats(const char *name, const Stats *s) {
+    fprintf(stderr,
+            "%s: %ld requests, %ld pages, %.1f MiB received (%.1f MiB decoded), "
+            "%ld rows, %ld duplicates, %ld endpoints\n"
+            "%s: request %.3fs, parse %.3fs, dedup %.3fs, classify %.3fs, sort %.3fs, serialize %.3fs\n",
+            name, s->requests, s->pages, (double)s->bytes / 1048576.0, (double)s->body_bytes / 1048576.0,
+            s->rows, s->duplicates, s->endpoints,
+            name, (double)s->request_ns / 1e9, (double)s->parse_ns / 1e9, (double)s->dedup_ns / 1e9,
+            (double)s->classify_ns / 1e9, (double)s->sort_ns / 1e9, (double)s->serialize_ns / 1e9);
+}
+
+[[nodiscard]] static json_t *stats_json(const Stats *s) {
+    json_t *o = json_object();
+    if (!o) { perror("json_object"); exit(1); }
+    json_object_set_new(o, "requests", json_integer(s->requests));
+    json_object_set_new(o, "pages", json_integer(s->pages));
+    json_object_set_new(o, "bytes", json_integer(s->bytes));
+    json_object_set_new(o, "body_bytes", json_integer(s->body_bytes));
+    json_object_set_new(o, "rows", json_integer(s->rows));
+    json_object_set_new(o, "duplicates", json_integer(s->duplicates));
+    json_object_set_new(o, "endpoints", json_integer(s->endpoints));
+    json_object_set_new(o, "request_s", json_real((double)s->request_ns / 1e9));
+    json_object_set_new(o, "parse_s", json_real((double)s->parse_ns / 1e9));
+    json_object_set_new(o, "dedup_s", json_real((double)s->dedup_ns / 1e9));
+    json_object_set_new(o, "classify_s", json_real((double)s->classify_ns / 1e9));
+    json_object_set_new(o, "sort_s", json_real((double)s->sort_ns / 1e9));
+    json_object_set_new(o, "serialize_s", json_real((double)s->serialize_ns / 1e9));
+    return o;
+}
+
+// Totals, wall time and peak RSS of the run; written to --stats-file if given.
+static void report_stats(EventLoop *loop, long long start_ns) {
+    const Options *opts = loop->opts;
+    struct rusage ru;
+    const long peak_kib = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+    const double wall = (double)(monotonic_ns() - start_ns) / 1e9;
+
+    print_stats("total", &loop->total);
+    fprintf(stderr, "total: %.3fs wall, %.0f rows/s, peak RSS %.1f MiB\n",
+            wall, wall > 0 ? (double)loop->total.rows / wall : 0.0, (double)peak_kib / 1024.0);
+    if (!opts->stats_file) return;
+
+    json_t *root = json_object(), *total = stats_json(&loop->total);
+    if (!root) { perror("json_object"); exit(1); }
+    json_object_set_new(total, "wall_s", json_real(wall));
+    json_object_set_new(total, "peak_rss_bytes", json_integer((json_int_t)peak_kib * 1024));
+    json_object_set_new(root, "domains", loop->stats_domains ? loop->stats_domains : json_array());
+    json_object_set_new(root, "total", total);
+    loop->stats_domains = NULL;
+    if (json_dump_file(root, opts->stats_file, JSON_INDENT(2)) != 0) {
+        fprintf(stderr, "Failed to write %s\n", opts->stats_file);
+        ++loop->failed;
+    }
+    json_decref(root);
+}
+
+// Writes the output of a finished job, closes its journals and frees it; on
+// the writer thread under --threads.
+static void retire_job(EventLoop *loop, DomainJob *job) {
+    job->out.pipe = NULL;  // earlier buffers are already written
+    write_output(loop, job);
+    job->stats.endpoints = job->endpoint_count;
+    if (job->journal.fp) {
+        if (!job->failed && !job->resumed_done) jw_lit(&job->journal, "{\"done\":true}\n");
+        journal_close(job);
+    }
+    if (job->state.fp) state_close(job, loop->opts->query_scope);
+    free_intern_table(&job->seen);
+    free_intern_table(&job->params);
+    arena_free(&job->arena);
+    free(job->endpoints);
+
+    if (!loop->opts->verbose) {
+        fprintf(info_stream(loop->opts), "\nRecon %s for %s. %s output saved to %s\n",
+                job->failed ? "incomplete" : "complete", job->domain,
+                loop->opts->format == FORMAT_NDJSON ? "NDJSON" : "JSON",
+                job->quiet ? "stdout" : job->output_path);
+    }
+    if (tracing) trace_span("domain", job->domain, -1, job->trace_start_ns, monotonic_ns(), 1);
+    if (loop->opts->stats) {
+        print_stats(job->domain, &job->stats);
+        stats_add(&loop->total, &job->stats);
+        if (loop->opts->stats_file) {
+            if (!loop->stats_domains && !(loop->stats_domains = json_array())) { perror("json_array"); exit(1); }
+            json_t *o = stats_json(&job->stats);
+            json_object_set_new(o, "domain", json_string(job->domain));
+            json_array_append_new(loop->stats_domains, o);
+        }
+    }
+    free(job);
+}
+
+static void pipeline_retire(Pipeline *p, DomainJob *job);
+
+// Every request of the job is done: hands its handles back to the loop and
+// retires it.
+static void finish_job(EventLoop *loop, DomainJob *job) {
+    // A key still queued behind a slot another parser has not filled yet
+    // would be taken after the job is gone; take_key() finishes it instead.
+    if (atomic_load(&job->keys_queued) > 0) {
+        job->finishing = 1;
+        return;
+    }
+    for (int i = 0; i < job->transfer_count + job->partner_count; ++i) {
+        release_handle(loop, job->transfers[i].curl);
+        free(job->transfers[i].chunk.data);
+        cdx_parser_free(&job->transfers[i].parser);
+    }
+    free(job->transfers);
+    for (int i = 0; i < max(loop->opts->slice_count, 1); ++i) free(job->resume_keys[i]);
+    free(job->resume_keys);
+    free(job->slice_done);
+    free(job->page_done);
+    if (job->failed) ++loop->failed;
+    --loop->active;
+
+    if (loop->pipe) pipeline_retire(loop->pipe, job);
+    else retire_job(loop, job);
+}
+
+static int start_job(EventLoop *loop, const char *domain) {
+    if (!domain || domain[0] == '\0' || strlen(domain) > MAX_DOMAIN_LEN) {
+        fprintf(stderr, "Invalid domain: empty or too long\n");
+        return 1;
+    }
+
+    DomainJob *job = calloc(1, sizeof *job);
+    if (!job) { perror("calloc"); exit(1); }
+    safe_strcpy(job->domain, domain, sizeof(job->domain));
+    job->seen.arena = &job->arena;
+    job->params.arena = &job->arena;
+    job->quiet = output_is_stdout(loop->opts);
+    job->timed = loop->opts->stats || tracing;
+    if (loop->pipe) {
+        job->pipe = loop->pipe;
+        job->progress = &loop->progress;
+    }
+    if (tracing) job->trace_start_ns = monotonic_ns();
+    if (loop->opts->output_template) {
+        expand_output_template(loop->opts->output_template, domain, job->output_path, sizeof(job->output_path));
+    } else {
+        safe_strcpy(job->output_path, loop->opts->output_file, sizeof(job->output_path));
+    }
+    if (loop->opts->format == FORMAT_NDJSON && loop->opts->sort == SORT_NONE) {
+        if (loop->opts->output_template) {
+            make_parent_dirs(job->output_path);
+            jw_open(&job->out, job->output_path, loop->opts, DOMAIN_WRITER_BUFFER);
+            job->out.pipe = loop->pipe;
+            job->stream = &job->out;
+        } else {
+            job->stream = &loop->out;
+        }
+    }
+    if (strstr(domain, "://") == NULL) {
+        snprintf(job->full_domain, sizeof(job->full_domain), "http://%s", domain);
+    } else {
+        safe_strcpy(job->full_domain, domain, sizeof(job->full_domain));
+    }
+
+    const int paged = loop->opts->page_concurrency > 0;
+    const int slice_count = max(loop->opts->slice_count, 1);
+    job->resume_keys = calloc(slice_count, sizeof *job->resume_keys);
+    job->slice_done = calloc(slice_count, 1);
+    if (!job->resume_keys || !job->slice_done) { perror("calloc"); exit(1); }
+    job->transfer_count = paged ? loop->opts->page_concurrency
+                                : min(max(loop->opts->slice_concurrency, 1), slice_count);
+    job->partner_count = loop->pipe && !paged ? job->transfer_count : 0;
+    job->transfers = calloc(job->transfer_count + job->partner_count, sizeof *job->transfers);
+    if (!job->transfers) { perror("calloc"); exit(1); }
+    for (int i = 0; i < job->partner_count; ++i) {
+        job->transfers[i].partner = &job->transfers[job->transfer_count + i];
+        job->transfers[job->transfer_count + i].partner = &job->transfers[i];
+    }
+
+    for (int i = 0; i < job->transfer_count + job->partner_count; ++i) {
+        Transfer *t = &job->transfers[i];
+        t->job = job;
+        t->curl = acquire_handle(loop);
+        if (!t->curl) {
+            fprintf(stderr, "curl_easy_init() failed\n");
+            for (int j = 0; j < i; ++j) release_handle(loop, job->transfers[j].curl);
+            if (job->stream == &job->out) jw_close(&job->out);
+            free(job->transfers);
+            free(job->resume_keys);
+            free(job->slice_done);
+            free(job);
+            return 1;
+        }
+        curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, (void *)t);
+        curl_easy_setopt(t->curl, CURLOPT_PRIVATE, (void *)t);
+        t->parser.text = loop->opts->cdx_text;
+        if (loop->pipe) t->lane = loop->next_lane++ % loop->opts->threads;
+    }
+
+    fprintf(info_stream(loop->opts), "\n=== Processing: %s ===\n", job->domain);
+    ++loop->active;
+
+    if (loop->opts->state_dir) {
+        char tpl[MAX_LINE_LEN];
+        snprintf(tpl, sizeof(tpl), "%s/{domain}.state", loop->opts->state_dir);
+        expand_output_template(tpl, domain, job->state_path, sizeof(job->state_path));
+        make_parent_dirs(job->state_path);
+        const long known = journal_replay(job, job->state_path, NULL, 0, 0, loop->opts->query_scope);
+        safe_strcpy(job->newest, job->since, sizeof(job->newest));
+        if (known >= 0) {
+            fprintf(stderr, "Updating %s: %ld known endpoints, captures since %s\n", job->domain, known,
+                    job->since[0] ? job->since : "the beginning");
+        }
+        state_open(job);
+    }
+    if (loop->opts->checkpoint_dir) {
+        char tpl[MAX_LINE_LEN];
+        snprintf(tpl, sizeof(tpl), "%s/{domain}.journal", loop->opts->checkpoint_dir);
+        expand_output_template(tpl, domain, job->journal_path, sizeof(job->journal_path));
+        make_parent_dirs(job->journal_path);
+        // Rows of the killed run may not have reached the state file yet.
+        const long rows = journal_replay(job, job->journal_path, job->state.fp ? &job->state : NULL, paged,
+                                         slice_count, NULL);
+        if (rows >= 0) {
+            fprintf(stderr, "Resuming %s from %s: %ld endpoints%s\n", job->domain, job->journal_path, rows,
+                    job->resumed_done ? ", already finished" : "");
+        }
+        journal_open(job);
+    }
+
+    if (job->resumed_done) {
+        finish_job(loop, job);
+    } else if (paged && job->page_done) {
+        for (int i = 0; i < job->transfer_count && start_next_page(loop, &job->transfers[i]); ++i) {}
+        if (job->inflight == 0) finish_job(loop, job);
+    } else if (paged) {
+        start_transfer(loop, &job->transfers[0], REQ_NUM_PAGES, 0);
+    } else {
+        for (int i = 0; i < job->transfer_count && start_next_slice(loop, &job->transfers[i]); ++i) {}
+        if (job->inflight == 0) finish_job(loop, job);
+    }
+    return 0;
+}
+
+static void pipeline_end(Pipeline *p, Transfer *t);
+static void pipeline_forget(Pipeline *p, Transfer *t);
+static void complete_transfer(EventLoop *loop, Transfer *t, int ok, int transient, int page);
+
+static void handle_done(EventLoop *loop, CURL *easy, CURLcode res) {
+    Transfer *t = NULL;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&t);
+    curl_multi_remove_handle(loop->multi, easy);
+    DomainJob *job = t->job;
+    --loop->running;
+    if (job->pipe) pipeline_forget(job->pipe, t);
+
+    curl_off_t bytes = 0, usec = 0;
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    if (loop->opts->byte_rate > 0) loop->byte_tokens -= (double)bytes;
+    ++job->stats.requests;
+    job->stats.bytes += bytes;
+    if (tracing) {
+        static const char *const request_names[] = { [REQ_CHAIN] = "request", [REQ_NUM_PAGES] = "showNumPages",
+                                                     [REQ_PAGE] = "request" };
+        trace_span(request_names[t->kind], job->domain, t->kind == REQ_NUM_PAGES ? -1 : t->page,
+                   t->sent_ns, monotonic_ns(), 1);
+    }
+    if (job->timed && curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &usec) == CURLE_OK) {
+        job->stats.request_ns += (long long)usec * 1000;
+    }
+
+    // ok: a complete reply; transient: worth sending again.
+    int ok = res == CURLE_OK, transient = 1;
+    if (ok) {
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &t->status);
+        if (t->status == 429 || t->status == 503) {
+            curl_off_t retry_after = 0;
+            curl_easy_getinfo(easy, CURLINFO_RETRY_AFTER, &retry_after);
+            ++t->attempts;
+            throttle(loop, t, retry_after);
+            if (t->attempts <= MAX_THROTTLE_RETRIES) {
+                --job->inflight;
+                enqueue_transfer(loop, t);
+                return;
+            }
+            fprintf(stderr, "HTTP %ld for %s: giving up after %d attempts\n", t->status, job->domain, t->attempts);
+            ok = transient = 0;
+        } else if (t->status < 200 || t->status >= 300) {
+            fprintf(stderr, "HTTP %ld for %s\n", t->status, job->domain);
+            ok = 0;
+            transient = t->status >= 500;
+        } else {
+            speed_up(loop);
+        }
+    } else if (res == CURLE_WRITE_ERROR && job->pipe && atomic_load(&t->parse_failed)) {
+        // The parser thread has reported it.
+    } else if (res == CURLE_WRITE_ERROR && !job->pipe && t->parser.state == CDX_ERROR) {
+        (void)finish_page(t);
+    } else {
+        fprintf(stderr, "curl error for %s: %s\n", job->domain, curl_easy_strerror(res));
+    }
+
+    // The rows still queued for a parser thread, and how the page ended,
+    // come back through pipeline_drain(), which completes the transfer.
+    if (job->pipe && (t->fed || (ok && t->kind != REQ_NUM_PAGES))) {
+        t->pend_ok = ok;
+        t->pend_transient = transient;
+        pipeline_end(job->pipe, t);
+        return;
+    }
+    int page = 0;  // finish_page() of a complete row reply
+    if (ok && t->kind != REQ_NUM_PAGES && (page = finish_page(t)) < 0) ok = 0;
+    complete_transfer(loop, t, ok, transient, page);
+}
+
+static void complete_transfer(EventLoop *loop, Transfer *t, int ok, int transient, int page) {
+    DomainJob *job = t->job;
+    // The partner journals the key this page was fetched with once all its
+    // rows are taken; a newer key journaled before that would make a resume
+    // skip them.
+    if (job->journal.fp && t->partner && t->partner->prefetched) {
+        t->held = 1;
+        t->pend_ok = ok;
+        t->pend_transient = transient;
+        t->pend_page = page;
+        return;
+    }
+    --job->inflight;
+    t->busy = 0;
+    // The resumeKey is the last row, so a page that gave it up has delivered
+    // all the others, however its reply ended.
+    if (t->prefetched) ok = 1;
+    if (ok && t->kind != REQ_NUM_PAGES) ++job->stats.pages;
+
+    if (!ok) {
+        if (transient && t->retries < loop->opts->retries) {
+            retry_transfer(loop, t);
+            return;
+        }
+        if (transient && t->retries > 0) fprintf(stderr, "Giving up on %s after %d retries\n", job->domain, t->retries);
+        job->failed = 1;
+        free(t->chunk.data); t->chunk.data = NULL; t->chunk.size = 0;
+        if (t->kind == REQ_PAGE) start_next_page(loop, t);
+        else if (t->kind == REQ_CHAIN) start_next_slice(loop, t);
+    } else if (t->kind == REQ_NUM_PAGES) {
+        job->num_pages = parse_num_pages(&t->chunk);
+        if (job->num_pages < 0) {
+            fprintf(stderr, "showNumPages unsupported for %s, following resumeKey chain\n", job->domain);
+            start_transfer(loop, t, REQ_CHAIN, 0);
+        } else {
+            if (loop->opts->verbose) {
+                fprintf(info_stream(loop->opts), "%s: %ld pages\n", job->domain, job->num_pages);
+                fflush(info_stream(loop->opts));
+            }
+            if (job->journal.fp) journal_num_pages(job);
+            for (int i = 0; i < job->transfer_count && start_next_page(loop, &job->transfers[i]); ++i) {}
+        }
+    } else if (t->kind == REQ_PAGE) {
+        if (job->journal.fp) journal_page(job, t->page);
+        start_next_page(loop, t);
+    } else if (t->prefetched) {
+        // The partner already carries the chain on.
+        if (job->journal.fp) journal_resume_key(job, t->page, t->prefetched, loop->opts->slice_count > 1);
+        free(t->prefetched);
+        t->prefetched = NULL;
+    } else if (page == 0 && job->resume_keys[t->page]) {
+        if (job->journal.fp) journal_resume_key(job, t->page, job->resume_keys[t->page], loop->opts->slice_count > 1);
+        start_transfer(loop, t, REQ_CHAIN, t->page);
+    } else {
+        // The slice's chain has ended; a finished domain gets {"done":true} instead.
+        if (job->journal.fp && loop->opts->slice_count > 1) journal_slice(job, t->page);
+        start_next_slice(loop, t);
+    }
+
+    // The page held back for t's key; it finishes the job if it is the last.
+    if (t->partner && t->partner->held) {
+        Transfer *next = t->partner;
+        next->held = 0;
+        complete_transfer(loop, next, next->pend_ok, next->pend_transient, next->pend_page);
+        return;
+    }
+    if (job->inflight == 0) finish_job(loop, job);
+}
+
+// --threads: a staged pipeline around the event loop.
+//
+//   event loop ──lane (SPSC)──> parser threads ──batches (MPSC)──> event loop ──(SPSC)──> writer thread
+//    curl I/O                    tokenize, infer method            dedup, params,         output files,
+//                                                                  scheduling, journal    retired jobs
+//
+// Each transfer is pinned to one lane, so its deliveries are parsed in order.
+// The event loop stays the only thread that touches a job while it runs: it
+// is the single aggregator because it also owns the resumeKeys, retries and
+// checkpoint journal that the parse results feed. A resumeKey also travels
+// on a queue of its own that the loop reads first, so the next page of a
+// chain is requested while the rows before the key still wait their turn.
+// Backpressure runs the other way: a full batch queue stops the parsers, a
+// full lane pauses the curl transfers feeding it, and a full writer queue
+// stops the event loop.
+typedef struct {
+    Transfer *t;
+    int end;      // no data: the reply is over, send back how it ended
+    size_t len;
+    char data[];
+} Block;
+
+// Bounded single-producer single-consumer queue of pointers. The semaphores
+// count filled and free slots, so a side only sleeps when it cannot go on.
+typedef struct {
+    void **slots;
+    unsigned cap;
+    unsigned head;          // consumer side
+    unsigned tail;          // producer side
+    sem_t items;
+    sem_t space;
+    atomic_int want_space;  // a ring_try_push() failed; the next pop wakes the event loop
+} Ring;
+
+typedef struct {
+    Pipeline *pipe;
+    pthread_t thread;
+    Ring blocks;
+} Lane;
+
+typedef struct RowBatch {
+    Transfer *t;
+    int end;      // the transfer's last batch; page is finish_page() of the reply
+    int page;
+    unsigned attempt;  // a resumeKey sent on the side: t->attempt it came from
+    size_t len;
+    size_t cap;
+    char data[];  // PackedRow records
+} RowBatch;
+
+typedef struct {
+    uint32_t url_len;
+    uint32_t mime_len;   // UINT32_MAX: no mimetype
+    int32_t method;      // -1: a resumeKey row, with the key in place of the URL
+    char timestamp[14];  // all zero unless the row had a 14-digit one
+} PackedRow;             // followed by the URL and the mimetype bytes
+
+// Bounded multi-producer queue of row batches, emptied by the event loop.
+typedef struct {
+    _Atomic(RowBatch *) *slots;  // NULL while free
+    unsigned cap;
+    unsigned head;               // event loop side
+    atomic_uint tail;
+    sem_t space;
+} BatchQueue;
+
+typedef struct {
+    FILE *fp;
+    char *buf;           // NULL: close fp once everything before is written
+    size_t len;
+    DomainJob *job;      // a finished job to retire instead
+} WriteMsg;
+
+struct Pipeline {
+    EventLoop *loop;
+    int threads;
+    Lane *lanes;
+    BatchQueue batches;
+    BatchQueue keys;               // resumeKeys, read ahead of the rows that precede them
+    int wake_fd;                   // eventfd in the event loop's epoll set
+    atomic_int wake_pending;
+    Transfer *paused;              // waiting for room in their lane
+    pthread_t writer;
+    Ring writes;
+};
+
+static void sem_wait_nointr(sem_t *s) {
+    while (sem_wait(s) != 0) {
+        if (errno != EINTR) { perror("sem_wait"); exit(1); }
+    }
+}
+
+static void ring_init(Ring *r, unsigned cap) {
+    *r = (Ring){ .slots = calloc(cap, sizeof *r->slots), .cap = cap };
+    if (!r->slots) { perror("calloc"); exit(1); }
+    if (sem_init(&r->items, 0, 0) != 0 || sem_init(&r->space, 0, cap) != 0) { perror("sem_init"); exit(1); }
+}
+
+static void ring_free(Ring *r) {
+    sem_destroy(&r->items);
+    sem_destroy(&r->space);
+    free(r->slots);
+}
+
+static void ring_put(Ring *r, void *msg) {
+    r->slots[r->tail++ % r->cap] = msg;
+    sem_post(&r->items);
+}
+
+static void ring_push(Ring *r, void *msg) {
+    sem_wait_nointr(&r->space);
+    ring_put(r, msg);
+}
+
+// Never blocks; returns 0 if the ring is full.
+static int ring_try_push(Ring *r, void *msg) {
+    if (sem_trywait(&r->space) != 0) {
+        // Look again after raising the flag, or a pop in between would not wake anyone.
+        atomic_store(&r->want_space, 1);
+        if (sem_trywait(&r->space) != 0) return 0;
+    }
+    ring_put(r, msg);
+    return 1;
+}
+
+static void *ring_pop(Ring *r) {
+    sem_wait_nointr(&r->items);
+    void *msg = r->slots[r->head++ % r->cap];
+    sem_post(&r->space);
+    return msg;
+}
+
+// Wakes the event loop; one eventfd write per wakeup however many threads ask.
+static void pipeline_wake(Pipeline *p) {
+    if (atomic_exchange(&p->wake_pending, 1)) return;
+    const uint64_t one = 1;
+    if (write(p->wake_fd, &one, sizeof one) < 0 && errno != EAGAIN) { perror("eventfd"); exit(1); }
+}
+
+static void batch_queue_init(BatchQueue *q, unsigned cap) {
+    *q = (BatchQueue){ .slots = calloc(cap, sizeof *q->slots), .cap = cap };
+    if (!q->slots) { perror("calloc"); exit(1); }
+    if (sem_init(&q->space, 0, cap) != 0) { perror("sem_init"); exit(1); }
+}
+
+static void batch_queue_free(BatchQueue *q) {
+    sem_destroy(&q->space);
+    free(q->slots);
+}
+
+static void batch_queue_push(Pipeline *p, BatchQueue *q, RowBatch *b) {
+    sem_wait_nointr(&q->space);
+    const unsigned slot = atomic_fetch_add(&q->tail, 1) % q->cap;
+    atomic_store_explicit(&q->slots[slot], b, memory_order_release);
+    pipeline_wake(p);
+}
+
+// Event loop side; NULL if the queue is empty.
+static RowBatch *batch_queue_pop(BatchQueue *q) {
+    _Atomic(RowBatch *) *slot = &q->slots[q->head % q->cap];
+    RowBatch *b = atomic_load_explicit(slot, memory_order_acquire);
+    if (!b) return NULL;
+    atomic_store_explicit(slot, NULL, memory_order_relaxed);
+    ++q->head;
+    sem_post(&q->space);
+    return b;
+}
+
+static void pipeline_send_batch(Pipeline *p, RowBatch *b) { batch_queue_push(p, &p->batches, b); }
+
+static char *batch_reserve(Transfer *t, size_t n) {
+    RowBatch *b = t->batch;
+    if (!b || b->cap - b->len < n) {
+        const size_t len = b ? b->len : 0;
+        size_t cap = b ? b->cap * 2 : DOMAIN_WRITER_BUFFER / 4;
+        while (cap - len < n) cap *= 2;
+        RowBatch *grown = realloc(b, sizeof *grown + cap);
+        if (!grown) { perror("realloc"); exit(1); }
+        if (!b) *grown = (RowBatch){ .t = t };
+        grown->cap = cap;
+        t->batch = b = grown;
+    }
+    char *out = b->data + b->len;
+    b->len += n;
+    return out;
+}
+
+static void pack_row(Transfer *t, int method, const CdxField *url, const CdxField *timestamp,
+                     const CdxField *mimetype) {
+    PackedRow r = { .url_len = (uint32_t)url->len, .mime_len = UINT32_MAX, .method = method };
+    if (timestamp && timestamp->len == 14) memcpy(r.timestamp, timestamp->ptr, 14);
+    if (mimetype && mimetype->ptr) r.mime_len = (uint32_t)mimetype->len;
+    const size_t mime_len = mimetype && mimetype->ptr ? mimetype->len : 0;
+    char *out = batch_reserve(t, sizeof r + url->len + mime_len);
+    memcpy(out, &r, sizeof r);
+    memcpy(out + sizeof r, url->ptr, url->len);
+    if (mime_len) memcpy(out + sizeof r + url->len, mimetype->ptr, mime_len);
+}
+
+// handle_row() on a parser thread: the method is inferred here, everything
+// that touches the job is left to take_batch().
+static void pipe_row(void *userp, long row, const CdxField *fields, int nfields) {
+    Transfer *t = userp;
+    if (row == 0) return;
+
+    if (nfields == 0) {
+        t->saw_blank_row = 1;
+    } else if (t->saw_blank_row && nfields == 1) {
+        if (t->kind == REQ_CHAIN && fields[0].ptr && fields[0].len > 0) {
+            pack_row(t, -1, &fields[0], NULL, NULL);
+            // Also sent on its own, so the next page need not wait for the rows queued before it.
+            if (t->partner) {
+                RowBatch *key = malloc(sizeof *key + fields[0].len);
+                if (!key) { perror("malloc"); exit(1); }
+                *key = (RowBatch){ .t = t, .attempt = t->attempt, .len = fields[0].len, .cap = fields[0].len };
+                memcpy(key->data, fields[0].ptr, fields[0].len);
+                atomic_fetch_add(&t->job->keys_queued, 1);
+                batch_queue_push(t->job->pipe, &t->job->pipe->keys, key);
+            }
+        }
+    } else if (nfields >= 4 && fields[0].ptr) {
+        const long long t0 = t->job->timed ? monotonic_ns() : 0;
+        const Method method = infer_method(fields[0].ptr, fields[0].len, fields[3].ptr, fields[3].len);
+        if (t->job->timed) t->classify_ns += monotonic_ns() - t0;
+        pack_row(t, (int)method, &fields[0], &fields[1], &fields[3]);
+    }
+}
+
+static void *parser_main(void *arg) {
+    Lane *lane = arg;
+    Pipeline *p = lane->pipe;
+    if (tracing) trace_thread_name("parser");
+    Block *b;
+    while ((b = ring_pop(&lane->blocks))) {
+        if (atomic_exchange(&lane->blocks.want_space, 0)) pipeline_wake(p);
+        Transfer *t = b->t;
+        DomainJob *job = t->job;
+        if (b->end) {
+            int page = 0;
+            if (t->pend_ok && t->kind != REQ_NUM_PAGES) page = atomic_load(&t->parse_failed) ? -1 : finish_page(t);
+            (void)batch_reserve(t, 0);
+            RowBatch *last = t->batch;
+            last->end = 1;
+            last->page = page;
+            t->batch = NULL;
+            pipeline_send_batch(p, last);  // t may be reused or freed from here on
+        } else if (!atomic_load(&t->parse_failed)) {
+            const long long classified = t->classify_ns;
+            const long long t0 = job->timed ? monotonic_ns() : 0;
+            if (cdx_parser_feed(&t->parser, b->data, b->len) != 0) {
+                (void)finish_page(t);
+                atomic_store(&t->parse_failed, 1);
+            }
+            if (job->timed) {
+                const long long t1 = monotonic_ns();
+                t->parse_ns += t1 - t0 - (t->classify_ns - classified);
+                if (tracing) trace_span("parse", job->domain, t->page, t0, t1, 0);
+            }
+            if (t->batch) {
+                RowBatch *rows = t->batch;
+                t->batch = NULL;
+                pipeline_send_batch(p, rows);
+            }
+        }
+        free(b);
+    }
+    return NULL;
+}
+
+static void *writer_main(void *arg) {
+    Pipeline *p = arg;
+    if (tracing) trace_thread_name("writer");
+    WriteMsg *m;
+    while ((m = ring_pop(&p->writes))) {
+        if (m->job) {
+            retire_job(p->loop, m->job);
+        } else if (m->buf) {
+            if (fwrite(m->buf, 1, m->len, m->fp) != m->len) { perror("fwrite"); exit(1); }
+            free(m->buf);
+        } else if (m->fp != stdout && fclose(m->fp) != 0) {
+            perror("fclose");
+            exit(1);
+        }
+        free(m);
+    }
+    return NULL;
+}
+
+static void pipeline_write(Pipeline *p, FILE *fp, char *buf, size_t len) {
+    WriteMsg *m = malloc(sizeof *m);
+    if (!m) { perror("malloc"); exit(1); }
+    *m = (WriteMsg){ .fp = fp, .buf = buf, .len = len };
+    ring_push(&p->writes, m);
+}
+
+static void pipeline_retire(Pipeline *p, DomainJob *job) {
+    EventLoop *loop = p->loop;
+    if (loop->progress.len) jw_flush(&loop->progress);
+    if (job->stream == &loop->out) jw_flush(&loop->out);
+    WriteMsg *m = malloc(sizeof *m);
+    if (!m) { perror("malloc"); exit(1); }
+    *m = (WriteMsg){ .job = job };
+    ring_push(&p->writes, m);
+}
+
+static void pipeline_pause(Pipeline *p, Transfer *t) {
+    t->paused = 1;
+    t->next_paused = p->paused;
+    p->paused = t;
+}
+
+// Drops t from the paused list, e.g. when curl gave up on it while paused.
+static void pipeline_forget(Pipeline *p, Transfer *t) {
+    if (!t->paused) return;
+    for (Transfer **link = &p->paused; *link; link = &(*link)->next_paused) {
+        if (*link == t) { *link = t->next_paused; break; }
+    }
+    t->paused = 0;
+    t->pend_end = 0;
+}
+
+// Write callback under --threads: copies the delivery into t's lane, or
+// pauses the transfer while the lane is full.
+static size_t pipeline_feed(Pipeline *p, Transfer *t, const char *data, size_t len) {
+    if (atomic_load(&t->parse_failed)) return 0;  // aborts the transfer, as inline parsing does
+    Block *b = malloc(sizeof *b + len);
+    if (!b) { perror("malloc"); exit(1); }
+    *b = (Block){ .t = t, .len = len };
+    memcpy(b->data, data, len);
+    if (!ring_try_push(&p->lanes[t->lane].blocks, b)) {
+        free(b);
+        pipeline_pause(p, t);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    t->fed = 1;
+    t->job->stats.body_bytes += (long long)len;
+    return len;
+}
+
+// Queues the end marker behind t's deliveries; its batch completes t.
+static void pipeline_end(Pipeline *p, Transfer *t) {
+    Block *b = malloc(sizeof *b);
+    if (!b) { perror("malloc"); exit(1); }
+    *b = (Block){ .t = t, .end = 1 };
+    if (!ring_try_push(&p->lanes[t->lane].blocks, b)) {
+        free(b);
+        t->pend_end = 1;
+        pipeline_pause(p, t);
+    }
+}
+
+// Gives every transfer held up by a full lane another try.
+static void pipeline_resume(Pipeline *p) {
+    Transfer *t = p->paused;
+    p->paused = NULL;
+    while (t) {
+        Transfer *next = t->next_paused;
+        t->paused = 0;
+        if (t->pend_end) {
+            t->pend_end = 0;
+            pipeline_end(p, t);
+        } else {
+            curl_easy_pause(t->curl, CURLPAUSE_CONT);  // may deliver, and pause, right away
+        }
+        t = next;
+    }
+}
+
+static void take_batch(EventLoop *loop, RowBatch *b) {
+    Transfer *t = b->t;
+    DomainJob *job = t->job;
+    for (size_t off = 0; off < b->len;) {
+        PackedRow r;
+        memcpy(&r, b->data + off, sizeof r);
+        const CdxField url = { b->data + off + sizeof r, r.url_len };
+        const CdxField mimetype = { r.mime_len == UINT32_MAX ? NULL : url.ptr + url.len,
+                                    r.mime_len == UINT32_MAX ? 0 : r.mime_len };
+        off += sizeof r + url.len + mimetype.len;
+        if (r.method < 0) {
+            if (!t->prefetched) set_resume_key(job, t->page, &url);
+        } else {
+            const CdxField timestamp = { r.timestamp, r.timestamp[0] ? 14 : 0 };
+            take_capture(job, &url, &timestamp, &mimetype, r.method);
+        }
+    }
+    const int end = b->end, page = b->page;
+    free(b);
+    // A delivery's endpoints go downstream now, as inline; the shared stream
+    // is flushed once per wakeup instead.
+    if (job->stream == &job->out && job->out.len) jw_flush(&job->out);
+    if (end) {
+        job->stats.parse_ns += t->parse_ns;
+        job->stats.classify_ns += t->classify_ns;
+        complete_transfer(loop, t, t->pend_ok && page >= 0, t->pend_transient, page);
+    }
+}
+
+// A parser thread has found t's resumeKey: unless t's partner is still busy
+// with the page before, it fetches the next page right away. A key that
+// comes in after t's reply was completed is dropped; t has moved on, or the
+// chain went on from the key's row.
+static void take_key(EventLoop *loop, RowBatch *b) {
+    Transfer *t = b->t;
+    DomainJob *job = t->job;
+    if (t->busy && t->attempt == b->attempt && !t->partner->busy) {
+        const CdxField key = { b->data, b->len };
+        set_resume_key(job, t->page, &key);
+        t->prefetched = strdup(job->resume_keys[t->page]);
+        if (!t->prefetched) { perror("strdup"); exit(1); }
+        start_transfer(loop, t->partner, REQ_CHAIN, t->page);
+    }
+    free(b);
+    if (atomic_fetch_sub(&job->keys_queued, 1) == 1 && job->finishing) finish_job(loop, job);
+}
+
+static void take_keys(EventLoop *loop) {
+    for (RowBatch *b; (b = batch_queue_pop(&loop->pipe->keys));) take_key(loop, b);
+}
+
+// The event loop's side of the batch queues, run when the eventfd fires.
+static void pipeline_drain(EventLoop *loop) {
+    Pipeline *p = loop->pipe;
+    uint64_t n;
+    // Read, then clear: cleared first, a wakeup in between would be read
+    // away with wake_pending left set, and no later one would write again.
+    // The exchange also makes every batch queued before it visible.
+    if (read(p->wake_fd, &n, sizeof n) < 0 && errno != EAGAIN) { perror("eventfd"); exit(1); }
+    (void)atomic_exchange(&p->wake_pending, 0);
+
+    take_keys(loop);
+    for (RowBatch *b; (b = batch_queue_pop(&p->batches));) {
+        // Keys usually come before the batch holding their row, but not
+        // always: a slot another parser has claimed and not yet filled holds
+        // back the keys behind it.
+        take_keys(loop);
+        take_batch(loop, b);
+    }
+    if (loop->out.pipe && loop->out.len) jw_flush(&loop->out);
+    if (loop->progress.len) {
+        jw_flush(&loop->progress);
+        fflush(stdout);
+    }
+    pipeline_resume(p);
+}
+
+static Pipeline *pipeline_start(EventLoop *loop) {
+    Pipeline *p = calloc(1, sizeof *p);
+    if (!p) { perror("calloc"); exit(1); }
+    p->loop = loop;
+    p->threads = loop->opts->threads;
+    p->lanes = calloc(p->threads, sizeof *p->lanes);
+    if (!p->lanes) { perror("calloc"); exit(1); }
+    batch_queue_init(&p->batches, PIPE_ROW_BATCHES);
+    batch_queue_init(&p->keys, PIPE_ROW_BATCHES);
+    p->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p->wake_fd < 0) { perror("eventfd"); exit(1); }
+
+    ring_init(&p->writes, PIPE_WRITES);
+    if (pthread_create(&p->writer, NULL, writer_main, p) != 0) { perror("pthread_create"); exit(1); }
+    for (int i = 0; i < p->threads; ++i) {
+        p->lanes[i].pipe = p;
+        ring_init(&p->lanes[i].blocks, PIPE_LANE_BLOCKS);
+        if (pthread_create(&p->lanes[i].thread, NULL, parser_main, &p->lanes[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    return p;
+}
+
+// Call once every job is finished: the lanes and the batch queue are empty.
+static void pipeline_stop(Pipeline *p) {
+    for (int i = 0; i < p->threads; ++i) {
+        ring_push(&p->lanes[i].blocks, NULL);
+        pthread_join(p->lanes[i].thread, NULL);
+        ring_free(&p->lanes[i].blocks);
+    }
+    ring_push(&p->writes, NULL);
+    pthread_join(p->writer, NULL);
+    ring_free(&p->writes);
+    batch_queue_free(&p->batches);
+    batch_queue_free(&p->keys);
+    close(p->wake_fd);
+    free(p->lanes);
+    free(p);
+}
+
+static int socket_cb(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    (void)easy;
+    EventLoop *loop = userp;
+    struct epoll_event ev = {0};
+    ev.data.fd = s;
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+        return 0;
+    }
+    if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+
+    if (!socketp) {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) != 0 && errno != EEXIST) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        curl_multi_assign(loop->multi, s, (void *)1);
+    } else if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static int timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+    (void)multi;
+    EventLoop *loop = userp;
+    loop->timer_deadline = timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+    return 0;
+}
+
+static void drain_completed(EventLoop *loop) {
+    CURLMsg *msg;
+    int pending;
+    while ((msg = curl_multi_info_read(loop->multi, &pending))) {
+        if (msg->msg == CURLMSG_DONE) handle_done(loop, msg->easy_handle, msg->data.result);
+    }
+}
+
+[[nodiscard]] int process_domains(DomainSource *src, const Options *opts) {
+    EventLoop loop = { .timer_deadline = -1, .opts = opts, .dispatch_deadline = -1 };
+    const long long start_ns = monotonic_ns();
+    if (opts->trace_file) {
+        trace_open(opts->trace_file);
+        trace_thread_name("event loop");
+    }
+    loop.max_window = opts->concurrency * requests_per_domain(opts);
+    loop.window = loop.max_window;
+    loop.tokens = 1.0;
+    loop.refill_ms = monotonic_ms();
+    loop.rng = ((uint64_t)loop.refill_ms * 0x9E3779B97F4A7C15ULL ^ (uint64_t)getpid()) | 1;
+
+    loop.multi = curl_multi_init();
+    loop.share = curl_share_init();
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!loop.multi || !loop.share || loop.epfd < 0) {
+        fprintf(stderr, "event loop setup failed\n");
+        return 1;
+    }
+    // One thread drives every handle, so the share needs no lock callbacks.
+    curl_share_setopt(loop.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(loop.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(loop.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    // Idle connections to keep: enough for every transfer that can be in flight.
+    curl_multi_setopt(loop.multi, CURLMOPT_MAXCONNECTS, (long)opts->concurrency * requests_per_domain(opts));
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETDATA, &loop);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERDATA, &loop);
+    if (!opts->output_template) jw_open(&loop.out, opts->output_file, opts, JSON_WRITER_BUFFER);
+    if (opts->threads > 0) {
+        loop.pipe = pipeline_start(&loop);
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = loop.pipe->wake_fd };
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.pipe->wake_fd, &ev) != 0) { perror("epoll_ctl"); return 1; }
+        loop.progress = (JsonWriter){ .fp = stdout, .buf = malloc(DOMAIN_WRITER_BUFFER), .cap = DOMAIN_WRITER_BUFFER,
+                                      .compact = 1, .format = FORMAT_NDJSON };
+        if (!loop.progress.buf) { perror("malloc"); exit(1); }
+        // Streamed NDJSON is flushed from the event loop; sorted output is
+        // written by the writer thread itself.
+        if (!opts->output_template && opts->format == FORMAT_NDJSON && opts->sort == SORT_NONE) {
+            loop.out.pipe = loop.pipe;
+        }
+    }
+
+    char domain[MAX_DOMAIN_LEN + 1];
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int running = 0;
+
+    for (;;) {
+        while (loop.active < opts->concurrency && next_domain(src, domain, sizeof(domain))) {
+            if (start_job(&loop, domain) != 0) {
+                fprintf(stderr, "Failed to process %s\n", domain);
+                ++loop.failed;
+            }
+        }
+        if (loop.active == 0) break;
+        loop.dispatch_deadline = dispatch(&loop);
+
+        int wait_ms = -1;
+        long long deadline = loop.timer_deadline;
+        if (loop.dispatch_deadline >= 0 && (deadline < 0 || loop.dispatch_deadline < deadline)) {
+            deadline = loop.dispatch_deadline;
+        }
+        if (deadline >= 0) {
+            long long left = deadline - monotonic_ms();
+            wait_ms = left > 0 ? (int)left : 0;
+        }
+
+        int n = epoll_wait(loop.epfd, events, MAX_EPOLL_EVENTS, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        int woken = 0;
+        for (int i = 0; i < n; ++i) {
+            if (loop.pipe && events[i].data.fd == loop.pipe->wake_fd) {
+                woken = 1;
+                continue;
+            }
+            int flags = 0;
+            if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(loop.multi, events[i].data.fd, flags, &running);
+        }
+        if (loop.timer_deadline >= 0 && monotonic_ms() >= loop.timer_deadline) {
+            loop.timer_deadline = -1;
+            curl_multi_socket_action(loop.multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+        drain_completed(&loop);
+        if (woken) pipeline_drain(&loop);
+    }
+
+    // Streamed output closes through the writer, behind its last buffers;
+    // otherwise the writer owns it until it stops.
+    if (!opts->output_template && loop.out.pipe) jw_close(&loop.out);
+    if (loop.pipe) {
+        pipeline_stop(loop.pipe);
+        jw_close(&loop.progress);
+    }
+    if (!opts->output_template && loop.out.fp) jw_close(&loop.out);
+    if (opts->stats) report_stats(&loop, start_ns);
+    trace_close();
+    for (int i = 0; i < loop.idle_count; ++i) curl_easy_cleanup(loop.idle_handles[i]);
+    free(loop.idle_handles);
+    curl_multi_cleanup(loop.multi);
+    curl_share_cleanup(loop.share);
+    close(loop.epfd);
+    return loop.failed;
+}
+
+#ifndef WAYBACK_RECON_NO_MAIN
+// "1500", "512K", "2M", "1G" (powers of 1024). Returns 0 on success.
+static int parse_byte_count(const char *s, long long *out) {
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || errno != 0 || v < 0) return 1;
+    int shift = 0;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        default: return 1;
+    }
+    if (*end != '\0' || v > (LLONG_MAX >> shift)) return 1;
+    *out = v << shift;
+    return 0;
+}
+
+// Appends &filter=[!]field:regex to buf. The server matches the regex against
+// the whole field; a leading '!' in spec (or negate) keeps the rows that do
+// not match. With list set, commas in spec become alternatives, so
+// "200,301" matches either. Returns 1 if buf is full.
+static int add_cdx_filter(char *buf, size_t size, const char *field, const char *spec, int negate, int list) {
+    if (*spec == '!') {
+        negate = 1;
+        ++spec;
+    }
+    size_t len = strlen(buf);
+    int n = snprintf(buf + len, size - len, "&filter=%s%s:", negate ? "!" : "", field);
+    if (n < 0 || (size_t)n >= size - len) return 1;
+    len += (size_t)n;
+    for (const unsigned char *c = (const unsigned char *)spec; *c; ++c) {
+        if (len + 4 > size) return 1;
+        if (isalnum(*c) || strchr("-._~", *c)) {
+            buf[len++] = (char)*c;
+        } else {
+            len += (size_t)snprintf(buf + len, size - len, "%%%02X", list && *c == ',' ? '|' : *c);
+        }
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+// A CDX timestamp bound: 1-14 digits, yyyyMMddhhmmss.
+static int is_timestamp(const char *s) {
+    const size_t len = strlen(s);
+    return len >= 1 && len <= 14 && strspn(s, "0123456789") == len;
+}
+
+// The slice a timestamp of at least four digits falls in; without a month,
+// quarter stands in for it.
+static int slice_index(const char *ts, int per_year, int quarter) {
+    int year = 0;
+    for (int i = 0; i < 4; ++i) year = year * 10 + (ts[i] - '0');
+    if (per_year == 4 && strlen(ts) >= 6) {
+        const int month = (ts[4] - '0') * 10 + (ts[5] - '0');
+        quarter = month >= 1 && month <= 12 ? (month - 1) / 3 : quarter;
+    }
+    return year * per_year + (per_year == 4 ? quarter : 0);
+}
+
+// Splits [from, to] into calendar years or quarters. The first and last
+// slice keep the exact bounds; open bounds run from FIRST_CAPTURE_YEAR to
+// the current year. Returns the slice count, or -1 with a message printed.
+static int build_slices(const TimeSlice *range, ShardUnit unit, TimeSlice *slices, int cap) {
+    const time_t now = time(NULL);
+    struct tm today;
+    gmtime_r(&now, &today);
+    if ((range->from[0] && strlen(range->from) < 4) || (range->to[0] && strlen(range->to) < 4)) {
+        fprintf(stderr, "Error: --shard needs --from/--to of at least a year\n");
+        return -1;
+    }
+    // Slices are numbered from year 0: year * per_year + quarter.
+    const int per_year = unit == SHARD_QUARTER ? 4 : 1;
+    int lo = FIRST_CAPTURE_YEAR * per_year;
+    int hi = (today.tm_year + 1900) * per_year + per_year - 1;
+    if (range->from[0]) lo = slice_index(range->from, per_year, 0);
+    if (range->to[0]) hi = slice_index(range->to, per_year, per_year - 1);
+    if (lo > hi) { fprintf(stderr, "Error: --from is after --to\n"); return -1; }
+    if (hi - lo + 1 > cap) { fprintf(stderr, "Error: --shard would need more than %d slices\n", cap); return -1; }
+
+    int n = 0;
+    for (int i = lo; i <= hi; ++i, ++n) {
+        TimeSlice *ts = &slices[n];
+        if (per_year == 4) {
+            snprintf(ts->from, sizeof(ts->from), "%04d%02d", i / 4, i % 4 * 3 + 1);
+            snprintf(ts->to, sizeof(ts->to), "%04d%02d", i / 4, i % 4 * 3 + 3);
+        } else {
+            snprintf(ts->from, sizeof(ts->from), "%04d", i);
+            snprintf(ts->to, sizeof(ts->to), "%04d", i);
+        }
+    }
+    if (range->from[0]) safe_strcpy(slices[0].from, range->from, sizeof(slices[0].from));
+    if (range->to[0]) safe_strcpy(slices[n - 1].to, range->to, sizeof(slices[n - 1].to));
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    Options opts = {
+        .output_file = "endpoints.json",
+        .limit = 100000,
+        .timeout = 60,
+        .concurrency = 1,
+        .retries = 5,
+    };
+    const char *domain = NULL;
+    TimeSlice range = {0};
+    ShardUnit shard = SHARD_NONE;
+    static char filters[MAX_FILTERS_LEN];
+    opts.cdx_filters = filters;
+
+    int i = 1;
+    while (i < argc) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_help(argv[0]);
+            return 0;
+        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --output requires a filename\n"); return 1; }
+            opts.output_file = argv[i];
+        } else if (strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "--output-template") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --output-template requires a template\n"); return 1; }
+            opts.output_template = argv[i];
+            if (!strstr(opts.output_template, "{domain}")) {
+                fprintf(stderr, "Error: --output-template must contain {domain}\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--append") == 0) {
+            opts.append = 1;
+        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--limit") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --limit is required\n"); return 1; }
+            opts.limit = atol(argv[i]);
+            if (opts.limit <= 0 || opts.limit > 150000) {
+                fprintf(stderr, "Error: limit must be 1150000\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timeout") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --timeout requires seconds\n"); return 1; }
+            opts.timeout = atol(argv[i]);
+            if (opts.timeout <= 0) { fprintf(stderr, "Error: timeout must be > 0\n"); return 1; }
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            opts.verbose = 1;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--sort") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --sort requires asc/desc/none\n"); return 1; }
+            if (strcmp(argv[i], "desc") == 0) opts.sort = SORT_DESC;
+            else if (strcmp(argv[i], "asc") == 0) opts.sort = SORT_ASC;
+            else if (strcmp(argv[i], "none") == 0) opts.sort = SORT_NONE;
+            else {
+                fprintf(stderr, "Error: --sort must be asc, desc or none\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --format requires json/ndjson\n"); return 1; }
+            if (strcmp(argv[i], "json") == 0) opts.format = FORMAT_JSON;
+            else if (strcmp(argv[i], "ndjson") == 0) opts.format = FORMAT_NDJSON;
+            else {
+                fprintf(stderr, "Error: --format must be json or ndjson\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--concurrency") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --concurrency requires a number\n"); return 1; }
+            opts.concurrency = atoi(argv[i]);
+            if (opts.concurrency <= 0 || opts.concurrency > MAX_CONCURRENCY) {
+                fprintf(stderr, "Error: concurrency must be 1-%d\n", MAX_CONCURRENCY); return 1;
+            }
+        } else if (strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "--pages") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --pages requires a number\n"); return 1; }
+            opts.page_concurrency = atoi(argv[i]);
+            if (opts.page_concurrency <= 0 || opts.page_concurrency > MAX_PAGE_CONCURRENCY) {
+                fprintf(stderr, "Error: pages must be 1-%d\n", MAX_PAGE_CONCURRENCY); return 1;
+            }
+        } else if (strcmp(argv[i], "--from") == 0 || strcmp(argv[i], "--to") == 0) {
+            const char *opt = argv[i];
+            if (++i >= argc || !is_timestamp(argv[i])) {
+                fprintf(stderr, "Error: %s requires a timestamp, 1-14 digits of yyyyMMddhhmmss\n", opt); return 1;
+            }
+            char *bound = opt[2] == 'f' ? range.from : range.to;
+            safe_strcpy(bound, argv[i], sizeof(range.from));
+        } else if (strcmp(argv[i], "--shard") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --shard requires year/quarter\n"); return 1; }
+            if (strcmp(argv[i], "year") == 0) shard = SHARD_YEAR;
+            else if (strcmp(argv[i], "quarter") == 0) shard = SHARD_QUARTER;
+            else {
+                fprintf(stderr, "Error: --shard must be year or quarter\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "--retries") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --retries requires a number\n"); return 1; }
+            opts.retries = atoi(argv[i]);
+            if (opts.retries < 0 || opts.retries > 100) { fprintf(stderr, "Error: retries must be 0-100\n"); return 1; }
+        } else if (strcmp(argv[i], "--checkpoint") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --checkpoint requires a directory\n"); return 1; }
+            opts.checkpoint_dir = argv[i];
+        } else if (strcmp(argv[i], "--state-dir") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --state-dir requires a directory\n"); return 1; }
+            opts.state_dir = argv[i];
+        } else if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--rate") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --rate requires a number\n"); return 1; }
+            char *end = NULL;
+            opts.rate = strtod(argv[i], &end);
+            if (*end != '\0' || !(opts.rate > 0)) { fprintf(stderr, "Error: rate must be > 0\n"); return 1; }
+        } else if (strcmp(argv[i], "-B") == 0 || strcmp(argv[i], "--bandwidth") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --bandwidth requires a number\n"); return 1; }
+            if (parse_byte_count(argv[i], &opts.byte_rate) != 0 || opts.byte_rate <= 0) {
+                fprintf(stderr, "Error: bandwidth must be a positive byte count, e.g. 512K or 2M\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            opts.stats = 1;
+        } else if (strcmp(argv[i], "--stats-file") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --stats-file requires a file\n"); return 1; }
+            opts.stats_file = argv[i];
+            opts.stats = 1;
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --threads requires a number\n"); return 1; }
+            opts.threads = atoi(argv[i]);
+            if (opts.threads < 0 || opts.threads > MAX_THREADS) {
+                fprintf(stderr, "Error: threads must be 0-%d\n", MAX_THREADS); return 1;
+            }
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --trace requires a file\n"); return 1; }
+            opts.trace_file = argv[i];
+        } else if (strcmp(argv[i], "--cdx-url") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --cdx-url requires a URL\n"); return 1; }
+            if (strlen(argv[i]) > MAX_URL_LEN / 4) { fprintf(stderr, "Error: --cdx-url is too long\n"); return 1; }
+            opts.cdx_url = argv[i];
+        } else if (strcmp(argv[i], "--cdx-output") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --cdx-output requires json/text\n"); return 1; }
+            if (strcmp(argv[i], "json") == 0) opts.cdx_text = 0;
+            else if (strcmp(argv[i], "text") == 0) opts.cdx_text = 1;
+            else {
+                fprintf(stderr, "Error: --cdx-output must be json or text\n"); return 1;
+            }
+        } else if (strcmp(argv[i], "--status") == 0 || strcmp(argv[i], "--mime") == 0 ||
+                   strcmp(argv[i], "--exclude-regex") == 0) {
+            const char *opt = argv[i];
+            if (++i >= argc || argv[i][0] == '\0') { fprintf(stderr, "Error: %s requires a pattern\n", opt); return 1; }
+            int full;
+            if (strcmp(opt, "--status") == 0) full = add_cdx_filter(filters, sizeof(filters), "statuscode", argv[i], 0, 1);
+            else if (strcmp(opt, "--mime") == 0) full = add_cdx_filter(filters, sizeof(filters), "mimetype", argv[i], 0, 1);
+            else full = add_cdx_filter(filters, sizeof(filters), "original", argv[i], 1, 0);
+            if (full) { fprintf(stderr, "Error: filters too long\n"); return 1; }
+        } else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--compact") == 0) {
+            opts.compact = 1;
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--rules") == 0) {
+            if (++i >= argc) { fprintf(stderr, "Error: --rules requires a filename\n"); return 1; }
+            opts.rules_file = argv[i];
+        } else if (strcmp(argv[i], "-") == 0) {
+            domain = NULL;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            print_help(argv[0]);
+            return 1;
+        } else if (strcmp(argv[i], "*") == 0 || (strlen(argv[i]) == 4 && is_timestamp(argv[i]))) {
+            // The [year] argument: one calendar year, or "*" for the full history.
+            if (strcmp(argv[i], "*") == 0) range = (TimeSlice){0};
+            else {
+                safe_strcpy(range.from, argv[i], sizeof(range.from));
+                safe_strcpy(range.to, argv[i], sizeof(range.to));
+            }
+        } else {
+            if (domain != NULL) {
+                fprintf(stderr, "Error: Only one domain allowed\n");
+                return 1;
+            }
+            domain = argv[i];
+        }
+        ++i;
+    }
+
+    // Bounds are prefixes, so compare them padded: to=2024 runs to the end of 2024.
+    if (range.from[0] && range.to[0] &&
+        strncmp(range.from, range.to, min((int)strlen(range.from), (int)strlen(range.to))) > 0) {
+        fprintf(stderr, "Error: --from is after --to\n");
+        return 1;
+    }
+    static char scope[MAX_FILTERS_LEN + 48];
+    snprintf(scope, sizeof(scope), "%s%s%s%s%s", range.from[0] ? "&from=" : "", range.from,
+             range.to[0] ? "&to=" : "", range.to, filters);
+    opts.query_scope = scope;
+    TimeSlice *slices = malloc(MAX_SLICES * sizeof *slices);
+    if (!slices) { perror("malloc"); return 1; }
+    slices[0] = range;
+    opts.slices = slices;
+    opts.slice_count = 1;
+    if (shard != SHARD_NONE) {
+        // -P sets how many slices of a domain are in flight; each one follows its own chain.
+        opts.slice_concurrency = opts.page_concurrency ? opts.page_concurrency : DEFAULT_SLICE_CONCURRENCY;
+        opts.page_concurrency = 0;
+        opts.slice_count = build_slices(&range, shard, slices, MAX_SLICES);
+        if (opts.slice_count < 0) return 1;
+    }
+
+    if (domain != NULL && (strlen(domain) == 0 || strlen(domain) > MAX_DOMAIN_LEN)) {
+        fprintf(stderr, "Invalid domain: empty or too long\n");
+        return 1;
+    }
+
+    // Several JSON arrays appended to one file would not parse as JSON.
+    if (opts.append && (opts.format != FORMAT_NDJSON || opts.output_template)) {
+        fprintf(stderr, "Error: --append needs --format ndjson and --output\n");
+        return 1;
+    }
+
+    if (method_rules_init(opts.rules_file) != 0) return 1;
+
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "curl_global_init() failed\n");
+        return 1;
+    }
+
+    DomainSource src = { .single = domain };
+    int failed = process_domains(&src, &opts);
+    curl_global_cleanup();
+    free(slices);
 
-    return process_domain(domain, output_file, limit, timeout, verbose, sort_desc);
+    // Piped batches keep going past bad lines; a single bad domain is an error.
+    return domain != NULL && failed ? 1 : 0;
 }
+#endif  // WAYBACK_RECON_NO_MAIN